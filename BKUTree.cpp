@@ -1,24 +1,453 @@
 #include <iostream>
 #include <vector>
 #include <queue>
+#include <string>
+#include <functional>
+#include <cmath>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <thread>
+#include <cstdio>
+#include <cstdint>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <string_view>
+#include <unordered_map>
+#include <type_traits>
 
 using namespace std;
 
-template <class K, class V>
+#if defined(__GNUC__)
+#define BKU_PREFETCH(addr) __builtin_prefetch(addr)
+#else
+#define BKU_PREFETCH(addr)
+#endif
+
+// Splay policies. budget() is asked on every access with the node's access
+// count and returns how many splay steps to take: -1 for all the way to the
+// root, 0 to leave the node where it is. A positive budget stops after that
+// many steps from the bottom of the path, which pushes the rest of the path
+// deeper; prefer 0 or -1. semi picks semi-splay steps instead of full ones.
+class AlwaysSplay {
+public:
+    static const bool semi = false;
+    int budget(int) { return -1; }
+};
+template <int k>
+class EveryKthSplay {
+public:
+    static const bool semi = false;
+    int budget(int accesses) { return accesses % k == 0 ? -1 : 0; }
+};
+template <int threshold>
+class ThresholdSplay {
+public:
+    static const bool semi = false;
+    int budget(int accesses) { return accesses >= threshold ? -1 : 0; }
+};
+// Semi-splay the whole access path. Each step on a straight path lifts only
+// the parent, which roughly halves the depth of every node on the path
+// instead of moving the accessed node to the root.
+class SemiSplay {
+public:
+    static const bool semi = true;
+    int budget(int) { return -1; }
+};
+
+// Heap bytes owned by a key or value beyond sizeof(T). Specialize it for
+// types that allocate so memoryUsage() can see their payload.
+template <class T>
+class HeapSize {
+public:
+    static size_t of(const T&) { return 0; }
+};
+template <>
+class HeapSize<string> {
+public:
+    static size_t of(const string& item)
+    {
+        // Short strings live inside the object itself.
+        const char* data = item.data();
+        if (data >= (const char*)&item && data < (const char*)(&item + 1)) return 0;
+        return item.capacity() + 1;
+    }
+};
+// Whether copies of a T share the heap block of the original, so only the
+// key held by the tree is charged for it.
+template <class T>
+class SharedHeap {
+public:
+    static const bool value = false;
+};
+
+// Binary encoding used by the write-ahead log. The default copies the bytes
+// of trivially copyable types; specialize it for anything else.
+template <class T>
+class Serializer {
+    static_assert(is_trivially_copyable<T>::value, "Serializer needs a specialization for this type");
+public:
+    static void write(string& out, const T& item)
+    {
+        out.append((const char*)&item, sizeof(T));
+    }
+    static bool read(FILE* in, T& item)
+    {
+        return fread(&item, sizeof(T), 1, in) == 1;
+    }
+};
+template <>
+class Serializer<string> {
+public:
+    static void write(string& out, const string& item)
+    {
+        uint32_t size = (uint32_t)item.size();
+        out.append((const char*)&size, sizeof(size));
+        out.append(item);
+    }
+    static bool read(FILE* in, string& item)
+    {
+        uint32_t size;
+        if (fread(&size, sizeof(size), 1, in) != 1) return false;
+        item.resize(size);
+        return size == 0 || fread(&item[0], 1, size, in) == size;
+    }
+};
+
+// How hard the write-ahead log tries to reach the disk: never fsync, fsync
+// once per batch of records, or fsync every record. With GROUP_COMMIT a crash
+// loses at most the last batchSize - 1 records, and never anything older than
+// maxDelayMs (plus one fsync); NO_SYNC only bounds what is still buffered in
+// the process, the OS may hold more. SYNC_EVERY loses nothing acknowledged.
+// A failed write or fsync makes add/remove throw with the tree unchanged, and
+// the log refuses every later record: what reached the disk is unknown.
+enum Durability { NO_SYNC, GROUP_COMMIT, SYNC_EVERY };
+
+// Where search found its answer, in the order the paths are tried.
+enum SearchPath { SPLAY_ROOT, KEYS_WINDOW, FINGER, ROOT_FALLBACK, MISS, NUM_SEARCH_PATHS };
+
+// Three-way key comparison for the AVL descent. lcp is a prefix length the
+// two keys are already known to share; key types that can use it update it
+// to the full common prefix. The default ignores it.
+template <class K>
+class KeyCompare {
+public:
+    static int compare(const K& a, const K& b, size_t&)
+    {
+        if (a == b) return 0;
+        return a < b ? -1 : 1;
+    }
+};
+
+// compare() for one step of a descent. lo and hi are the prefixes key shares
+// with the nearest keys passed on the left and on the right; every key below
+// lies between those two, so the comparison can start at the smaller. The
+// side other falls on takes the new prefix.
+template <class K>
+int compareWithin(const K& key, const K& other, size_t& lo, size_t& hi)
+{
+    size_t lcp = lo < hi ? lo : hi;
+    int cmp = KeyCompare<K>::compare(key, other, lcp);
+    if (cmp < 0) hi = lcp;
+    else lo = lcp;
+    return cmp;
+}
+
+class StringArena;
+
+// A string interned in a StringArena: a pointer and a length into an arena
+// slot. Equal strings share one slot, so equality is a pointer compare and
+// copying a key copies 16 bytes and bumps the slot's reference count. The
+// last copy to go hands the slot back to its arena. Keys from different
+// arenas never compare equal.
+class ArenaKey {
+public:
+    // Sits right before data in every slot.
+    class Header {
+    public:
+        atomic<int> refs;
+        StringArena* arena;
+    };
+    const char* data;
+    uint32_t size;
+
+    ArenaKey() : data(nullptr), size(0) {}
+    ArenaKey(const char* data, uint32_t size) : data(data), size(size) { this->retain(); }
+    ArenaKey(const ArenaKey& other) : data(other.data), size(other.size) { this->retain(); }
+    ArenaKey& operator=(const ArenaKey& other)
+    {
+        other.retain();
+        this->release();
+        this->data = other.data;
+        this->size = other.size;
+        return *this;
+    }
+    ~ArenaKey() { this->release(); }
+    string_view view() const { return string_view(this->data, this->size); }
+    Header* header() const { return (Header*)(this->data - sizeof(Header)); }
+    // Bytes of the arena slot holding a string of this length.
+    static size_t slotSize(size_t length)
+    {
+        size_t bytes = sizeof(Header) + length + 1;
+        return (bytes + alignof(Header) - 1) / alignof(Header) * alignof(Header);
+    }
+
+    bool operator==(const ArenaKey& other) const { return this->data == other.data; }
+    bool operator!=(const ArenaKey& other) const { return this->data != other.data; }
+    bool operator<(const ArenaKey& other) const { return this->view() < other.view(); }
+    bool operator>(const ArenaKey& other) const { return this->view() > other.view(); }
+
+private:
+    void retain() const
+    {
+        if (this->data) this->header()->refs.fetch_add(1);
+    }
+    inline void release();
+};
+
+// Storage for interned keys, one arena per tree. Slots are carved from large
+// chunks; a slot whose last key is gone goes on a free list for the next
+// string of the same slot size, so memory tracks the live key set. The owner
+// detaches on destruction and the arena deletes itself once no key is left,
+// which lets snapshots and copied keys outlive the tree.
+class StringArena {
+public:
+    vector<char*> chunks;
+    size_t used;
+    size_t chunkSize;
+    size_t bytes;
+    size_t live;
+    bool detached;
+    unordered_map<string_view, char*> table;
+    unordered_map<size_t, vector<char*> > freeSlots;
+    mutex lock;
+
+    StringArena(size_t chunkSize = 1 << 16)
+    {
+        this->chunkSize = chunkSize;
+        this->used = chunkSize;
+        this->bytes = 0;
+        this->live = 0;
+        this->detached = false;
+    }
+    ~StringArena()
+    {
+        for (size_t i = 0; i < this->chunks.size(); i++) delete[] this->chunks[i];
+    }
+    void detach()
+    {
+        bool last;
+        {
+            lock_guard<mutex> guard(this->lock);
+            this->detached = true;
+            last = this->live == 0;
+        }
+        if (last) delete this;
+    }
+
+    ArenaKey intern(string_view str)
+    {
+        lock_guard<mutex> guard(this->lock);
+        unordered_map<string_view, char*>::iterator it = this->table.find(str);
+        if (it != this->table.end()) return ArenaKey(it->second, (uint32_t)str.size());
+        char* data = this->allocate(ArenaKey::slotSize(str.size())) + sizeof(ArenaKey::Header);
+        ArenaKey::Header* header = (ArenaKey::Header*)(data - sizeof(ArenaKey::Header));
+        new (header) ArenaKey::Header();
+        header->refs = 0;
+        header->arena = this;
+        memcpy(data, str.data(), str.size());
+        data[str.size()] = '\0';
+        this->table[string_view(data, str.size())] = data;
+        this->live++;
+        return ArenaKey(data, (uint32_t)str.size());
+    }
+    // Find an interned key without adding it. A string that was never
+    // interned is in no tree, so a miss here is a definite miss.
+    bool lookup(string_view str, ArenaKey& key)
+    {
+        lock_guard<mutex> guard(this->lock);
+        unordered_map<string_view, char*>::iterator it = this->table.find(str);
+        if (it == this->table.end()) return false;
+        key = ArenaKey(it->second, (uint32_t)str.size());
+        return true;
+    }
+    // Called when a slot's count hits zero. intern may have revived it since,
+    // or another release got here first; only a slot still unused and still
+    // in the table is freed.
+    void release(const char* data, uint32_t size)
+    {
+        bool last = false;
+        {
+            lock_guard<mutex> guard(this->lock);
+            ArenaKey::Header* header = (ArenaKey::Header*)(data - sizeof(ArenaKey::Header));
+            unordered_map<string_view, char*>::iterator it = this->table.find(string_view(data, size));
+            if (header->refs.load() != 0 || it == this->table.end() || it->second != data) return;
+            this->table.erase(it);
+            this->freeSlots[ArenaKey::slotSize(size)].push_back((char*)header);
+            this->live--;
+            last = this->detached && this->live == 0;
+        }
+        if (last) delete this;
+    }
+    size_t memory()
+    {
+        lock_guard<mutex> guard(this->lock);
+        return this->bytes + this->table.size() * (sizeof(string_view) + sizeof(char*) + 2 * sizeof(void*))
+            + this->table.bucket_count() * sizeof(void*);
+    }
+
+private:
+    char* allocate(size_t size)
+    {
+        vector<char*>& reuse = this->freeSlots[size];
+        if (!reuse.empty())
+        {
+            char* slot = reuse.back();
+            reuse.pop_back();
+            return slot;
+        }
+        if (this->used + size > this->chunkSize || this->chunks.empty())
+        {
+            this->chunks.push_back(new char[size > this->chunkSize ? size : this->chunkSize]);
+            this->bytes += size > this->chunkSize ? size : this->chunkSize;
+            this->used = 0;
+        }
+        char* slot = this->chunks.back() + this->used;
+        // An oversized key fills its own chunk; start the next key on a fresh one.
+        this->used = size > this->chunkSize ? this->chunkSize : this->used + size;
+        return slot;
+    }
+};
+void ArenaKey::release()
+{
+    if (this->data && this->header()->refs.fetch_sub(1) == 1)
+        this->header()->arena->release(this->data, this->size);
+}
+
+// An interned key is charged its arena slot.
+template <>
+class HeapSize<ArenaKey> {
+public:
+    static size_t of(const ArenaKey& item)
+    {
+        return item.data ? ArenaKey::slotSize(item.size) : 0;
+    }
+};
+
+template <>
+class SharedHeap<ArenaKey> {
+public:
+    static const bool value = true;
+};
+
+// Compare from the first byte not already known to match: the descent passes
+// the common prefix it has established against the bounds of the subtree.
+template <>
+class KeyCompare<ArenaKey> {
+public:
+    static int compare(const ArenaKey& a, const ArenaKey& b, size_t& lcp)
+    {
+        if (a.data == b.data) return 0;
+        size_t n = a.size < b.size ? a.size : b.size;
+        size_t i = lcp;
+        while (i < n && a.data[i] == b.data[i]) i++;
+        lcp = i;
+        if (i == n) return a.size < b.size ? -1 : 1;
+        return (unsigned char)a.data[i] < (unsigned char)b.data[i] ? -1 : 1;
+    }
+};
+
+// Interned keys have one address each, which is all the filter needs.
+namespace std {
+template <>
+struct hash<ArenaKey> {
+    size_t operator()(const ArenaKey& key) const { return hash<const char*>()(key.data); }
+};
+}
+
+template <>
+class Serializer<ArenaKey> {
+public:
+    static void write(string& out, const ArenaKey& item)
+    {
+        out.append((const char*)&item.size, sizeof(item.size));
+        out.append(item.data, item.size);
+    }
+    // A key can only be read into an arena; StringBKUTree sets a readKey
+    // that interns into its own.
+    static bool read(FILE*, ArenaKey&)
+    {
+        throw "No arena to read keys into";
+    }
+};
+
+template <class K, class V, class SplayPolicy = AlwaysSplay>
 class BKUTree {
 public:
     class AVLTree;
     class SplayTree;
+    class CountingBloomFilter;
+    class WriteAheadLog;
 
-    class Entry {
+    // One recorded call: op is 'A' (add), 'R' (remove) or 'S' (search).
+    // time is nanoseconds since startTrace, or 0 when not timestamped.
+    class TraceRecord {
     public:
+        char op;
         K key;
         V value;
+        long long time;
+    };
+
+    class MemoryUsage {
+    public:
+        size_t nodes;
+        size_t keysWindow;
+        size_t payload;
+        size_t filter;
+        // Path-copied nodes of the current version while snapshots are on.
+        // Nodes only an older, still held Snapshot can see are not counted.
+        size_t snapshots;
+        size_t total()
+        {
+            return sizeof(BKUTree) + sizeof(AVLTree) + sizeof(SplayTree)
+                + nodes + keysWindow + payload + filter + snapshots;
+        }
+    };
+
+    // One node per key, linked into both trees at once: left/right with
+    // hL/hR and the subtree size are the AVL links, splayLeft/splayRight the
+    // splay links.
+    class Node {
+        K key;
+        V value;
+        Node* left;
+        Node* right;
+        int hL;
+        int hR;
+        int size;
+        Node* splayLeft;
+        Node* splayRight;
+        int accesses;
         friend class SplayTree;
         friend class AVLTree;
         friend class BKUTree;
-        friend class Node;
-        Entry(K key, V value) : key(key), value(value) {}
+
+        Node(K key = K(), V value = V()) : key(key), value(value) {
+            this->left = NULL;
+            this->right = NULL;
+            this->hL = 0;
+            this->hR = 0;
+            this->size = 1;
+            this->splayLeft = NULL;
+            this->splayRight = NULL;
+            this->accesses = 1;
+        }
     };
 
 public:
@@ -26,6 +455,18 @@ public:
     SplayTree* splay;
     queue<K> keys;
     int maxNumOfKeys;
+    CountingBloomFilter* filter;
+    size_t usedMemory;
+    size_t memoryLimit;
+    bool evictOnLimit;
+    WriteAheadLog* wal;
+    long searchPaths[NUM_SEARCH_PATHS];
+    vector<TraceRecord>* trace;
+    bool traceTimes;
+    bool snapshotsEnabled;
+    chrono::steady_clock::time_point traceStart;
+    // Decodes one key for openLog; empty means Serializer<K>::read.
+    function<bool(FILE*, K&)> readKey;
     friend class Node;
 
 public:
@@ -33,21 +474,332 @@ public:
     {
         this->maxNumOfKeys = maxNumOfKeys;
         this->splay = new SplayTree();
+        this->splay->ownsNodes = false;
         this->avl = new AVLTree();
+        this->filter = nullptr;
+        this->usedMemory = 0;
+        this->memoryLimit = 0;
+        this->evictOnLimit = false;
+        this->wal = nullptr;
+        this->trace = nullptr;
+        this->traceTimes = false;
+        this->snapshotsEnabled = false;
+        this->resetSearchPaths();
     }
     ~BKUTree() { this->clear(); }
 
+    void resetSearchPaths()
+    {
+        for (int i = 0; i < NUM_SEARCH_PATHS; i++) this->searchPaths[i] = 0;
+    }
+    // Record every add/remove/search from now on, for replayTrace.
+    void startTrace(bool timestamps = false)
+    {
+        delete this->trace;
+        this->trace = new vector<TraceRecord>();
+        this->traceTimes = timestamps;
+        this->traceStart = chrono::steady_clock::now();
+    }
+    vector<TraceRecord> stopTrace()
+    {
+        vector<TraceRecord> ret;
+        if (this->trace) ret.swap(*this->trace);
+        delete this->trace;
+        this->trace = nullptr;
+        return ret;
+    }
+    void record(char op, const K& key, const V* value)
+    {
+        TraceRecord rec = TraceRecord();
+        rec.op = op;
+        rec.key = key;
+        if (value) rec.value = *value;
+        if (this->traceTimes)
+            rec.time = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - this->traceStart).count();
+        this->trace->push_back(rec);
+    }
+    static void saveTrace(const string& path, vector<TraceRecord>& records)
+    {
+        FILE* out = fopen(path.c_str(), "wb");
+        if (!out)
+        {
+            throw "Cannot open trace";
+        }
+        string buffer;
+        for (size_t i = 0; i < records.size(); i++)
+        {
+            buffer.clear();
+            buffer.push_back(records[i].op);
+            Serializer<long long>::write(buffer, records[i].time);
+            Serializer<K>::write(buffer, records[i].key);
+            if (records[i].op == 'A') Serializer<V>::write(buffer, records[i].value);
+            fwrite(buffer.data(), 1, buffer.size(), out);
+        }
+        fclose(out);
+    }
+    // readKey defaults to Serializer<K>::read.
+    static vector<TraceRecord> loadTrace(const string& path, function<bool(FILE*, K&)> readKey = nullptr)
+    {
+        if (!readKey) readKey = &Serializer<K>::read;
+        FILE* in = fopen(path.c_str(), "rb");
+        if (!in)
+        {
+            throw "Cannot open trace";
+        }
+        vector<TraceRecord> records;
+        TraceRecord rec;
+        int op;
+        while ((op = fgetc(in)) != EOF)
+        {
+            rec.op = (char)op;
+            if (!Serializer<long long>::read(in, rec.time)) break;
+            if (!readKey(in, rec.key)) break;
+            if (op == 'A' && !Serializer<V>::read(in, rec.value)) break;
+            records.push_back(rec);
+        }
+        fclose(in);
+        return records;
+    }
+
+    // Make mutations durable under path (path.snap, path.log, path.log.old).
+    // Whatever those files hold is loaded first, so call this on an empty tree.
+    // A partial batch is flushed once its oldest record is maxDelayMs old; 0
+    // leaves it buffered until the batch fills or sync() is called. While the
+    // log is open AVL path copying stays on for compact(), so every key also
+    // has a PNode copy, counted against the memory limit.
+    void openLog(const string& path, Durability level = GROUP_COMMIT, int batchSize = 64, int maxDelayMs = 10)
+    {
+        if (this->wal)
+        {
+            throw "Log already open";
+        }
+        if (this->avl->head->left)
+        {
+            throw "Tree is not empty";
+        }
+        function<bool(FILE*, K&)> readKey = this->readKey;
+        if (!readKey) readKey = &Serializer<K>::read;
+        map<K, V> state;
+        WriteAheadLog::replay(path + ".snap", state, readKey);
+        bool interrupted = WriteAheadLog::replay(path + ".log.old", state, readKey) >= 0;
+        long end = WriteAheadLog::replay(path + ".log", state, readKey);
+        // Cut a torn tail off, or new records would land behind it and be
+        // lost with it on the next replay.
+        struct stat info;
+        if (end >= 0 && stat((path + ".log").c_str(), &info) == 0 && info.st_size > end
+            && truncate((path + ".log").c_str(), end) != 0)
+        {
+            throw "Cannot truncate log";
+        }
+        // A compaction died half way. Fold everything into a fresh snapshot
+        // before anything touches the logs; until it is on disk they are the
+        // only copy.
+        if (interrupted)
+        {
+            bool written = WriteAheadLog::writeRecords(path, [&](auto emit) {
+                for (typename map<K, V>::iterator it = state.begin(); it != state.end(); it++)
+                    emit(it->first, it->second);
+            });
+            if (!written)
+            {
+                throw "Cannot write snapshot";
+            }
+            std::remove((path + ".log.old").c_str());
+            FILE* log = fopen((path + ".log").c_str(), "wb");
+            if (log) fclose(log);
+        }
+        this->avl->enablePersistence();
+        this->bulkLoad(state);
+        this->wal = new WriteAheadLog(path, level, batchSize, maxDelayMs);
+    }
+    void sync()
+    {
+        if (this->wal && !this->wal->flush(true))
+        {
+            throw "Log write failed";
+        }
+    }
+    // Write the current contents to path.snap on a background thread and start
+    // a new log. Path copying is on while a log is open, so the snapshot the
+    // thread reads costs a refcount bump here.
+    void compact()
+    {
+        if (!this->wal) return;
+        this->wal->compact(this->avl->snapshot());
+    }
+    void closeLog()
+    {
+        if (!this->wal) return;
+        delete this->wal;
+        this->wal = nullptr;
+        if (!this->snapshotsEnabled)
+        {
+            this->avl->disablePersistence();
+            this->recountMemory();
+        }
+    }
+
+    // Build both trees in O(n) from keys in ascending order. The tree must be empty.
+    void bulkLoad(map<K, V>& sorted)
+    {
+        vector<Node*> nodes;
+        for (typename map<K, V>::iterator it = sorted.begin(); it != sorted.end(); it++)
+        {
+            nodes.push_back(new Node(it->first, it->second));
+            this->usedMemory += this->entryMemory(it->first, it->second);
+            if (this->filter) this->filter->add(it->first);
+        }
+        if (nodes.empty()) return;
+        this->avl->head->left = bulkBuild(nodes, 0, (int)nodes.size() - 1);
+        this->splay->head = this->avl->head->left;
+        if (this->avl->persistent)
+        {
+            this->avl->persistent = false;
+            this->avl->enablePersistence();
+        }
+    }
+    // Both trees get the same balanced shape.
+    Node* bulkBuild(vector<Node*>& nodes, int lo, int hi)
+    {
+        if (lo > hi) return nullptr;
+        int mid = lo + (hi - lo) / 2;
+        Node* node = nodes[mid];
+        node->left = node->splayLeft = bulkBuild(nodes, lo, mid - 1);
+        node->right = node->splayRight = bulkBuild(nodes, mid + 1, hi);
+        this->avl->calc_height(node);
+        return node;
+    }
+
+    // Put a counting Bloom filter in front of both trees. Keys already in the
+    // tree are loaded into it; afterwards add/remove keep it in sync.
+    void enableFilter(int expectedKeys, double falsePositiveRate = 0.01)
+    {
+        delete this->filter;
+        this->filter = new CountingBloomFilter(expectedKeys, falsePositiveRate);
+        this->fillFilter(this->avl->head->left);
+    }
+    void disableFilter()
+    {
+        delete this->filter;
+        this->filter = nullptr;
+    }
+    double filterFalsePositiveRate()
+    {
+        if (!this->filter) return 1.0;
+        return this->filter->falsePositiveRate();
+    }
+    size_t filterMemory()
+    {
+        if (!this->filter) return 0;
+        return this->filter->memory();
+    }
+
+    // Bytes one key costs: its node plus the heap payload of key and value,
+    // and the same again for its PNode copy while snapshots are on.
+    size_t entryMemory(const K& key, const V& value)
+    {
+        size_t bytes = sizeof(Node) + HeapSize<K>::of(key) + HeapSize<V>::of(value);
+        if (this->avl->persistent) bytes += sizeof(typename AVLTree::PNode) + copyPayload(key, value);
+        return bytes;
+    }
+    // Heap bytes a copy of an entry adds.
+    static size_t copyPayload(const K& key, const V& value)
+    {
+        return (SharedHeap<K>::value ? 0 : HeapSize<K>::of(key)) + HeapSize<V>::of(value);
+    }
+    // entryMemory changes when snapshots are switched, so start over.
+    void recountMemory()
+    {
+        size_t count = 0, payload = 0, copied = 0;
+        countAVL(this->avl->head->left, count, payload, copied);
+        this->usedMemory = count * sizeof(Node) + payload;
+        if (this->avl->persistent) this->usedMemory += count * sizeof(typename AVLTree::PNode) + copied;
+    }
+    // Cap the memory held by entries (0 turns the cap off). Over the cap, add
+    // either throws or, with evict set, evicts cold keys from the splay fringe
+    // until the new one fits. Eviction is a remove(): the key is deleted from
+    // both trees for good, and an open log records it as an 'R'.
+    void setMemoryLimit(size_t bytes, bool evict = false)
+    {
+        this->memoryLimit = bytes;
+        this->evictOnLimit = evict;
+    }
+    MemoryUsage memoryUsage()
+    {
+        MemoryUsage usage;
+        size_t count = 0, payload = 0, copied = 0;
+        countAVL(this->avl->head->left, count, payload, copied);
+        usage.nodes = (count + 1) * sizeof(Node);
+        usage.keysWindow = this->keys.size() * sizeof(K);
+        // Window keys are copies of tree keys; shared ones are already in payload.
+        for (size_t i = 0; i < this->keys.size() && !SharedHeap<K>::value; i++)
+        {
+            usage.keysWindow += HeapSize<K>::of(this->keys.front());
+            this->keys.push(this->keys.front());
+            this->keys.pop();
+        }
+        usage.payload = payload;
+        usage.filter = this->filterMemory();
+        usage.snapshots = 0;
+        if (this->avl->persistent)
+            usage.snapshots = count * (sizeof(typename AVLTree::PNode)) + copied;
+        return usage;
+    }
+    void countAVL(Node* root, size_t& count, size_t& payload, size_t& copied)
+    {
+        if (!root) return;
+        count++;
+        payload += HeapSize<K>::of(root->key) + HeapSize<V>::of(root->value);
+        copied += copyPayload(root->key, root->value);
+        countAVL(root->left, count, payload, copied);
+        countAVL(root->right, count, payload, copied);
+    }
+    // Follow the less accessed child from the splay root down to a leaf;
+    // splaying keeps recently used keys near the top, so that leaf is cold.
+    // Returns false when there is nothing left to evict.
+    bool evict()
+    {
+        Node* ptr = this->splay->head;
+        if (!ptr) return false;
+        while (ptr->splayLeft || ptr->splayRight)
+        {
+            if (!ptr->splayRight) ptr = ptr->splayLeft;
+            else if (!ptr->splayLeft) ptr = ptr->splayRight;
+            else if (ptr->splayLeft->accesses <= ptr->splayRight->accesses) ptr = ptr->splayLeft;
+            else ptr = ptr->splayRight;
+        }
+        this->remove(ptr->key);
+        return true;
+    }
+
     void add(K key, V value)
     {
-        if (this->avl->found(key))
+        if (this->trace) this->record('A', key, &value);
+        if ((!this->filter || this->filter->mayContain(key)) && this->avl->found(key))
         {
             throw "Duplicate key";
         }
-        Entry* entry = new Entry(key, value);
-        this->avl->add(entry);
-        this->splay->add(entry);
-        this->splay->head->corr = this->avl->recentNode;
-        this->avl->recentNode->corr = this->splay->head;
+        size_t cost = this->entryMemory(key, value);
+        if (this->memoryLimit && this->usedMemory + cost > this->memoryLimit)
+        {
+            if (!this->evictOnLimit || cost > this->memoryLimit)
+            {
+                throw "Memory limit exceeded";
+            }
+            while (this->usedMemory + cost > this->memoryLimit)
+            {
+                if (!this->evict())
+                {
+                    throw "Memory limit exceeded";
+                }
+            }
+        }
+        if (this->wal) this->wal->append('A', key, &value);
+        this->usedMemory += cost;
+        Node* node = new Node(key, value);
+        this->avl->add(node);
+        this->splay->add(node);
+        if (this->filter) this->filter->add(key);
 
         int size = keys.size();
         if (size < this->maxNumOfKeys)
@@ -61,35 +813,139 @@ public:
     }
     void remove(K key)
     {
-        if (!this->avl->found(key))
+        if (this->trace) this->record('R', key, nullptr);
+        if (this->filter && !this->filter->mayContain(key))
         {
             throw "Not found";
         }
+        Node* node = this->avl->Search(key, this->avl->head->left);
+        if (!node)
+        {
+            throw "Not found";
+        }
+        if (this->wal) this->wal->append('R', key, nullptr);
+        this->usedMemory -= this->entryMemory(node->key, node->value);
         this->splay->remove(key);
         this->avl->remove(key);
-        int range;
+        if (this->filter) this->filter->remove(key);
+        // Drop every copy of key from the window: a stale copy would keep an
+        // interned key's slot alive.
         int size = keys.size();
-
-        if (this->maxNumOfKeys > size) range = this->keys.size();
-        else range = this->maxNumOfKeys;
-        for (int i = 0; i < range; i++)
+        for (int i = 0; i < size; i++)
         {
-            if (keys.front() == key)
+            K front = keys.front();
+            keys.pop();
+            if (!(front == key)) keys.push(front);
+        }
+        if (this->splay->head && (int)keys.size() < this->maxNumOfKeys)
+            keys.push(this->splay->head->key);
+    }
+    // Remove every key in [lo, hi] in O(log n) plus the keys erased: the AVL
+    // tree splits off the range and joins the two sides, the splay tree
+    // unlinks it along the paths to its two ends.
+    int eraseRange(K lo, K hi)
+    {
+        if (hi < lo) return 0;
+        Node* cut = this->avl->cutRange(lo, hi);
+        if (!cut) return 0;
+        this->splay->cutRange(lo, hi);
+        vector<Node*> erased;
+        this->avl->Inorder(cut, erased);
+        if (this->avl->persistent)
+        {
+            typename AVLTree::PNode* root = this->avl->proot;
+            AVLTree::retain(root);
+            for (size_t i = 0; i < erased.size(); i++)
             {
-                keys.pop();
-                break;
+                typename AVLTree::PNode* next = this->avl->PRemove(root, erased[i]->key);
+                AVLTree::release(root);
+                root = next;
             }
-            keys.push(keys.front());
-            keys.pop();
+            this->avl->publish(root);
+        }
+        this->dropNodes(erased);
+        return (int)erased.size();
+    }
+    // Remove every key for which pred(key, value) is true in one pass: the
+    // survivors are collected in order and both trees rebuilt balanced from
+    // them, then the keys window is fixed up once. The splay tree loses its
+    // recency order, as after bulkLoad.
+    template <class F>
+    int eraseIf(F pred)
+    {
+        vector<Node*> kept, erased;
+        collect(this->avl->head->left, pred, kept, erased);
+        if (erased.empty()) return 0;
+        this->avl->head->left = kept.empty() ? nullptr : bulkBuild(kept, 0, (int)kept.size() - 1);
+        this->splay->head = this->avl->head->left;
+        this->dropNodes(erased);
+        if (this->avl->persistent)
+        {
+            this->avl->persistent = false;
+            this->avl->enablePersistence();
+        }
+        return (int)erased.size();
+    }
+    // Everything remove does for a key besides unlinking it, for nodes
+    // already cut out of both trees. The nodes are gone either way, so a log
+    // failure is only reported once the cleanup is done.
+    void dropNodes(vector<Node*>& erased)
+    {
+        bool logged = true;
+        for (size_t i = 0; i < erased.size(); i++)
+        {
+            Node* node = erased[i];
+            if (this->trace) this->record('R', node->key, nullptr);
+            this->usedMemory -= this->entryMemory(node->key, node->value);
+            if (this->filter) this->filter->remove(node->key);
+            if (this->wal && logged)
+            {
+                try { this->wal->append('R', node->key, nullptr); }
+                catch (const char*) { logged = false; }
+            }
+            delete node;
+        }
+        int size = this->keys.size();
+        for (int i = 0; i < size; i++)
+        {
+            K key = this->keys.front();
+            this->keys.pop();
+            if (this->avl->found(key)) this->keys.push(key);
+        }
+        if (!logged)
+        {
+            throw "Log write failed";
         }
-        keys.push(this->splay->head->entry->key);
+    }
+    template <class F>
+    void collect(Node* root, F& pred, vector<Node*>& kept, vector<Node*>& erased)
+    {
+        if (!root) return;
+        collect(root->left, pred, kept, erased);
+        if (pred(root->key, root->value)) erased.push_back(root);
+        else kept.push_back(root);
+        collect(root->right, pred, kept, erased);
     }
     V search(K key, vector<K>& traversedList)
     {
-        if (key == this->splay->head->entry->key)
-            return this->splay->head->entry->value;
+        if (this->trace) this->record('S', key, nullptr);
+        if (this->filter && !this->filter->mayContain(key))
+        {
+            this->searchPaths[MISS]++;
+            throw "Not found";
+        }
+        if (!this->splay->head)
+        {
+            this->searchPaths[MISS]++;
+            throw "Not found";
+        }
+        if (key == this->splay->head->key)
+        {
+            this->searchPaths[SPLAY_ROOT]++;
+            return this->splay->head->value;
+        }
         bool seen = false; int range;
-        if (this->maxNumOfKeys > this->keys.size()) range = this->keys.size();
+        if (this->maxNumOfKeys > (int)this->keys.size()) range = this->keys.size();
         else range = this->maxNumOfKeys;
         for (int i = 0; i < range; i++)
         {
@@ -102,36 +958,116 @@ public:
             keys.pop();
         }
         if (seen)
+        {
+            this->searchPaths[KEYS_WINDOW]++;
             return this->splay->search(key);
+        }
         else
         {
-            typename AVLTree::Node* ret = this->avl->SearchBKU(key, this->splay->head->corr, traversedList);
+            Node* ret = this->avl->SearchBKU(key, this->splay->head, traversedList);
             if (ret)
             {
-                if (key == ret->entry->key)
-                    return ret->entry->value;
+                if (key == ret->key)
+                {
+                    this->searchPaths[FINGER]++;
+                    return ret->value;
+                }
             }
             traversedList.clear();
-            typename AVLTree::Node* tmp = this->avl->searchBKU(key, this->avl->head->left, this->splay->head->corr, traversedList);
-            if (key == tmp->entry->key)
+            Node* tmp = this->avl->searchBKU(key, this->avl->head->left, this->splay->head, traversedList);
+            if (tmp && key == tmp->key)
             {
-                if (this->keys.size() < this->maxNumOfKeys)
+                if ((int)this->keys.size() < this->maxNumOfKeys)
                     this->keys.push(key);
                 else
                 {
                     this->keys.pop();
                     this->keys.push(key);
                 }
-                return this->splay->search(tmp->entry->key);
+                this->searchPaths[ROOT_FALLBACK]++;
+                return this->splay->search(tmp->key);
             }
             else
             {
+                this->searchPaths[MISS]++;
                 throw "Not found";
             }
         }
     }
 
-    void traverseNLROnAVL(void (*func)(K key, V value))
+    void enableSnapshots()
+    {
+        this->snapshotsEnabled = true;
+        this->avl->enablePersistence();
+        this->recountMemory();
+    }
+    // Snapshots already taken stay valid; they just stop sharing with the tree.
+    // An open log keeps path copying on until it is closed.
+    void disableSnapshots()
+    {
+        this->snapshotsEnabled = false;
+        if (this->wal) return;
+        this->avl->disablePersistence();
+        this->recountMemory();
+    }
+    typename AVLTree::Snapshot snapshot()
+    {
+        return this->avl->snapshot();
+    }
+
+    // Read-only batch lookup on the AVL tree: values[i] points at the value
+    // of keys[i], or is nullptr on a miss. The splay tree and keys window are
+    // not touched, and the pointers stay valid until the next add/remove.
+    void searchMany(const vector<K>& keys, vector<V*>& values, int group = 16)
+    {
+        vector<Node*> nodes(keys.size());
+        if (!keys.empty())
+            this->avl->multiSearch(&keys[0], (int)keys.size(), &nodes[0], group);
+        values.assign(keys.size(), nullptr);
+        for (size_t i = 0; i < keys.size(); i++)
+            if (nodes[i]) values[i] = &nodes[i]->value;
+    }
+
+    int size()
+    {
+        return AVLTree::size(this->avl->head->left);
+    }
+    // Number of keys smaller than key; key need not be present.
+    int rank(K key)
+    {
+        return this->avl->rank(key);
+    }
+    // The k-th smallest key, counting from 0.
+    K select(int k)
+    {
+        Node* node = this->avl->select(k);
+        if (!node)
+        {
+            throw "Out of range";
+        }
+        return node->key;
+    }
+    // Number of keys in [lo, hi].
+    int countRange(K lo, K hi)
+    {
+        if (hi < lo) return 0;
+        return this->avl->rank(hi, true) - this->avl->rank(lo);
+    }
+    // Smallest key with at least p (0..1) of the keys at or below it.
+    K percentile(double p)
+    {
+        int n = this->size();
+        if (n == 0)
+        {
+            throw "Out of range";
+        }
+        int k = (int)ceil(p * n) - 1;
+        if (k < 0) k = 0;
+        if (k >= n) k = n - 1;
+        return this->select(k);
+    }
+
+    void traverseNLROnAVL(void (*func)(K key, V value))
     {
         this->avl->traverseNLR(func);
     }
@@ -142,40 +1078,351 @@ public:
 
     void clear()
     {
-        this->avl->clear();
+        if (!this->avl) return;
+        this->closeLog();
+        delete this->trace;
+        this->trace = nullptr;
+        // The nodes are shared; the AVL clear is the one that frees them.
         this->splay->clear();
+        this->avl->clear();
         while (!this->keys.empty()) this->keys.pop();
         delete this->avl;
         delete this->splay;
+        delete this->filter;
         this->avl = nullptr;
         this->splay = nullptr;
+        this->filter = nullptr;
     }
 
-    class SplayTree {
+    void fillFilter(Node* root)
+    {
+        if (!root) return;
+        this->filter->add(root->key);
+        fillFilter(root->left);
+        fillFilter(root->right);
+    }
+
+    class WriteAheadLog {
     public:
-        class Node {
-            Entry* entry;
-            Node* left;
-            Node* right;
-            friend class SplayTree;
-            friend class BKUTree;
-            typename AVLTree::Node* corr;
-
-            Node(Entry* entry = NULL, Node* left = NULL, Node* right = NULL) {
-                this->entry = entry;
-                this->left = left;
-                this->right = right;
-                this->corr = NULL;
+        string path;
+        FILE* file;
+        Durability level;
+        int batchSize;
+        int pending;
+        string buffer;
+        thread compactor;
+        // Flushes a partial batch once its oldest record is maxDelay old.
+        thread flusher;
+        mutex lock;
+        condition_variable wake;
+        bool stopping;
+        bool failed;
+        chrono::milliseconds maxDelay;
+        // Taken from Serializer here rather than named in append, so a tree
+        // that never opens a log does not need serializable keys and values.
+        void (*writeKey)(string&, const K&);
+        void (*writeValue)(string&, const V&);
+        chrono::steady_clock::time_point oldest;
+
+        WriteAheadLog(const string& path, Durability level, int batchSize, int maxDelayMs)
+        {
+            this->path = path;
+            this->level = level;
+            this->batchSize = batchSize < 1 ? 1 : batchSize;
+            this->pending = 0;
+            this->stopping = false;
+            this->failed = false;
+            this->writeKey = &Serializer<K>::write;
+            this->writeValue = &Serializer<V>::write;
+            this->maxDelay = chrono::milliseconds(maxDelayMs);
+            this->file = fopen((path + ".log").c_str(), "ab");
+            if (!this->file)
+            {
+                throw "Cannot open log";
             }
-        };
+            if (level != SYNC_EVERY && maxDelayMs > 0)
+                this->flusher = thread(&WriteAheadLog::flushLoop, this);
+        }
+        ~WriteAheadLog()
+        {
+            {
+                lock_guard<mutex> guard(this->lock);
+                this->stopping = true;
+            }
+            this->wake.notify_one();
+            if (this->flusher.joinable()) this->flusher.join();
+            this->flush(true);
+            if (this->compactor.joinable()) this->compactor.join();
+            fclose(this->file);
+        }
+
+        // Records are 'A' key value or 'R' key. They are buffered and written
+        // with one fsync per batch (group commit) unless level says otherwise.
+        void append(char op, const K& key, const V* value)
+        {
+            lock_guard<mutex> guard(this->lock);
+            if (this->failed)
+            {
+                throw "Log write failed";
+            }
+            this->buffer.push_back(op);
+            this->writeKey(this->buffer, key);
+            if (value) this->writeValue(this->buffer, *value);
+            if (this->pending++ == 0)
+            {
+                this->oldest = chrono::steady_clock::now();
+                this->wake.notify_one();
+            }
+            if ((this->level == SYNC_EVERY || this->pending >= this->batchSize) && !this->Flush(this->level != NO_SYNC))
+            {
+                throw "Log write failed";
+            }
+        }
+        void flushLoop()
+        {
+            unique_lock<mutex> guard(this->lock);
+            while (!this->stopping)
+            {
+                if (this->pending == 0)
+                    this->wake.wait(guard);
+                else if (chrono::steady_clock::now() < this->oldest + this->maxDelay)
+                    this->wake.wait_until(guard, this->oldest + this->maxDelay);
+                else
+                    this->Flush(this->level != NO_SYNC);
+            }
+        }
+        bool flush(bool durable)
+        {
+            lock_guard<mutex> guard(this->lock);
+            return this->Flush(durable);
+        }
+        bool Flush(bool durable)
+        {
+            if (this->failed) return false;
+            bool ok = true;
+            if (!this->buffer.empty())
+            {
+                ok = fwrite(this->buffer.data(), 1, this->buffer.size(), this->file) == this->buffer.size();
+                this->buffer.clear();
+            }
+            ok = fflush(this->file) == 0 && ok;
+            if (durable) ok = fsync(fileno(this->file)) == 0 && ok;
+            this->pending = 0;
+            if (!ok) this->failed = true;
+            return ok;
+        }
+        void compact(typename AVLTree::Snapshot snapshot)
+        {
+            lock_guard<mutex> guard(this->lock);
+            if (this->compactor.joinable()) this->compactor.join();
+            if (!this->Flush(true))
+            {
+                throw "Log write failed";
+            }
+            fclose(this->file);
+            string log = this->path + ".log";
+            // The last snapshot write failed, so path.log.old still holds
+            // records no snapshot has. Fold it in front of the current log
+            // instead of renaming over it.
+            if (access((log + ".old").c_str(), F_OK) == 0 && !foldOldLog())
+            {
+                this->file = fopen(log.c_str(), "ab");
+                throw "Cannot fold old log";
+            }
+            rename(log.c_str(), (log + ".old").c_str());
+            this->file = fopen(log.c_str(), "ab");
+            if (!this->file)
+            {
+                throw "Cannot open log";
+            }
+            this->compactor = thread(&WriteAheadLog::writeSnapshot, this->path, snapshot);
+        }
+        // path.log.old + path.log becomes the new path.log. Replaying old
+        // records a second time is harmless, so a crash at any point is safe.
+        bool foldOldLog()
+        {
+            string log = this->path + ".log";
+            string tmp = log + ".tmp";
+            FILE* out = fopen(tmp.c_str(), "wb");
+            if (!out) return false;
+            bool ok = copyInto(log + ".old", out) && copyInto(log, out);
+            ok = fflush(out) == 0 && fsync(fileno(out)) == 0 && ok;
+            ok = fclose(out) == 0 && ok;
+            if (!ok || rename(tmp.c_str(), log.c_str()) != 0) return false;
+            std::remove((log + ".old").c_str());
+            return true;
+        }
+        static bool copyInto(const string& name, FILE* out)
+        {
+            FILE* in = fopen(name.c_str(), "rb");
+            if (!in) return true;
+            char chunk[1 << 14];
+            size_t n;
+            bool ok = true;
+            while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0)
+                if (fwrite(chunk, 1, n, out) != n) ok = false;
+            fclose(in);
+            return ok;
+        }
+        // path.log.old is dropped only once the snapshot is safely renamed into
+        // place; if anything fails it stays for recovery or the next compact.
+        static void writeSnapshot(string path, typename AVLTree::Snapshot snapshot)
+        {
+            bool written = writeRecords(path, [&](auto emit) { snapshot.forEach(emit); });
+            if (written) std::remove((path + ".log.old").c_str());
+        }
+        // Write path.snap through path.snap.tmp. each(emit) must call
+        // emit(key, value) for every key in ascending order.
+        template <class F>
+        static bool writeRecords(const string& path, F each)
+        {
+            string tmp = path + ".snap.tmp";
+            FILE* out = fopen(tmp.c_str(), "wb");
+            if (!out) return false;
+            bool ok = true;
+            string record;
+            each([&](const K& key, const V& value) {
+                record.clear();
+                record.push_back('A');
+                Serializer<K>::write(record, key);
+                Serializer<V>::write(record, value);
+                if (fwrite(record.data(), 1, record.size(), out) != record.size()) ok = false;
+            });
+            ok = fflush(out) == 0 && fsync(fileno(out)) == 0 && ok;
+            ok = fclose(out) == 0 && ok;
+            if (!ok || rename(tmp.c_str(), (path + ".snap").c_str()) != 0)
+            {
+                std::remove(tmp.c_str());
+                return false;
+            }
+            return true;
+        }
+        // Apply the records in name to state. Returns the offset just past the
+        // last complete record, or -1 when the file does not exist; a crash
+        // mid-write leaves a torn record after that offset.
+        static long replay(const string& name, map<K, V>& state, function<bool(FILE*, K&)>& readKey)
+        {
+            FILE* in = fopen(name.c_str(), "rb");
+            if (!in) return -1;
+            int op;
+            K key;
+            V value;
+            long end = 0;
+            while ((op = fgetc(in)) != EOF)
+            {
+                if (op != 'A' && op != 'R') break;
+                if (!readKey(in, key)) break;
+                if (op == 'A')
+                {
+                    if (!Serializer<V>::read(in, value)) break;
+                    state[key] = value;
+                }
+                else state.erase(key);
+                end = ftell(in);
+            }
+            fclose(in);
+            return end;
+        }
+    };
+
+    class CountingBloomFilter {
+    public:
+        vector<unsigned char> counters;
+        int numOfHashes;
+        int numOfKeys;
+        // Taken from std::hash here rather than named in add/remove/mayContain,
+        // so a tree that never enables the filter does not need std::hash<K>.
+        size_t (*hasher)(const K&);
+
+        CountingBloomFilter(int expectedKeys, double falsePositiveRate)
+        {
+            this->hasher = &CountingBloomFilter::hashOf;
+            if (expectedKeys < 1) expectedKeys = 1;
+            if (falsePositiveRate <= 0 || falsePositiveRate >= 1) falsePositiveRate = 0.01;
+            double ln2 = log(2.0);
+            size_t size = (size_t)ceil(-expectedKeys * log(falsePositiveRate) / (ln2 * ln2));
+            if (size < 8) size = 8;
+            this->counters.assign(size, 0);
+            this->numOfHashes = (int)round((double)size / expectedKeys * ln2);
+            if (this->numOfHashes < 1) this->numOfHashes = 1;
+            this->numOfKeys = 0;
+        }
+
+        static size_t hashOf(const K& key)
+        {
+            return hash<K>()(key);
+        }
+        // Double hashing: slot i is h1 + i * h2, both taken from one std::hash.
+        size_t slot(size_t h, int i)
+        {
+            size_t h1 = h;
+            size_t h2 = (h >> 17) | (h << 47);
+            h2 = h2 * 0x9E3779B97F4A7C15ULL | 1;
+            return (h1 + i * h2) % this->counters.size();
+        }
+        void add(K key)
+        {
+            size_t h = this->hasher(key);
+            for (int i = 0; i < this->numOfHashes; i++)
+            {
+                unsigned char& c = this->counters[slot(h, i)];
+                if (c < 255) c++;
+            }
+            this->numOfKeys++;
+        }
+        void remove(K key)
+        {
+            size_t h = this->hasher(key);
+            for (int i = 0; i < this->numOfHashes; i++)
+            {
+                unsigned char& c = this->counters[slot(h, i)];
+                // A saturated counter has lost its count, so it stays put.
+                if (c > 0 && c < 255) c--;
+            }
+            this->numOfKeys--;
+        }
+        bool mayContain(K key)
+        {
+            size_t h = this->hasher(key);
+            for (int i = 0; i < this->numOfHashes; i++)
+            {
+                if (this->counters[slot(h, i)] == 0) return false;
+            }
+            return true;
+        }
+        // Expected rate for the keys currently held, not the configured target.
+        double falsePositiveRate()
+        {
+            double m = (double)this->counters.size();
+            double k = (double)this->numOfHashes;
+            return pow(1 - exp(-k * this->numOfKeys / m), k);
+        }
+        size_t memory()
+        {
+            return sizeof(CountingBloomFilter) + this->counters.capacity() * sizeof(unsigned char);
+        }
+    };
+
+    class SplayTree {
+    public:
+        typedef typename BKUTree::Node Node;
 
     public:
         Node* head;
+        SplayPolicy policy;
+        bool ownsNodes;
+        int budget;
+        long rotations;
+        // Links from the root down to the last node reached, for SemiSplaying.
+        vector<Node**> path;
         friend class AVLTree;
         friend class BKUTree;
         SplayTree() : head(NULL)
         {
             this->head = nullptr;
+            this->ownsNodes = true;
+            this->budget = -1;
+            this->rotations = 0;
         }
         ~SplayTree() { this->clear(); };
 
@@ -185,58 +1432,71 @@ public:
             {
                 throw "Duplicate key";
             }
-            Entry* entry = new Entry(key, value);
-            add(entry);
+            add(new Node(key, value));
         }
-        void add(Entry* entry)
+        void add(Node* node)
         {
-            if (found(entry->key))
+            if (found(node->key))
             {
                 throw "Duplicate key";
             }
+            this->budget = this->policy.budget(1);
+            if (SplayPolicy::semi)
+            {
+                Node** link = this->descend(node->key);
+                *link = node;
+                this->SemiSplaying();
+                return;
+            }
             Node* temp = this->head; int save = 0;
-            Add(temp, temp, temp, temp, 0, save, entry);
+            Add(temp, temp, temp, temp, 0, save, node);
         }
-        void Add(Node*& grandparent, Node*& parent, Node*& root, Node*& child, int cost, int& save, Entry* entry)
+        // lo and hi carry the key's common prefix with the bounds of the
+        // subtree, as in AVLTree::Search; so do Splaying and Search.
+        void Add(Node*& grandparent, Node*& parent, Node*& root, Node*& child, int cost, int& save, Node* node, size_t lo = 0, size_t hi = 0)
         {
             if (this->head == nullptr)
             {
-                this->head = new Node(entry, NULL, NULL);
+                this->head = node;
                 return;
             }
             if (!child)
             {
-                child = new Node(entry, NULL, NULL);
+                child = node;
             }
-            if (entry->key < child->entry->key)
+            size_t lcp = lo < hi ? lo : hi;
+            int cmp = KeyCompare<K>::compare(node->key, child->key, lcp);
+            if (cmp < 0)
             {
                 save += 1;
-                Add(parent, root, child, child->left, cost + 1, save, entry);
+                Add(parent, root, child, child->splayLeft, cost + 1, save, node, lo, lcp);
             }
-            else if (entry->key > child->entry->key)
+            else if (cmp > 0)
             {
                 save += 1;
-                Add(parent, root, child, child->right, cost + 1, save, entry);
+                Add(parent, root, child, child->splayRight, cost + 1, save, node, lcp, hi);
             }
             if (cost == save)
             {
-                Splay(grandparent, parent, root, child, entry->key);
+                Splay(grandparent, parent, root, child, node->key);
                 save -= 2;
             }
         }
-        void Splay(Node* grandparent, Node* parent, Node* root, Node* child, K key)
+        void Splay(Node* grandparent, Node* parent, Node* root, Node* child, const K& key)
         {
-            if (this->head->left != nullptr)
+            if (this->budget == 0) return;
+            if (this->budget > 0) this->budget--;
+            if (this->head->splayLeft != nullptr)
             {
-                if (this->head->left->entry->key == key) {
-                    Zig_rotation(this->head, this->head, this->head->left);
+                if (this->head->splayLeft->key == key) {
+                    Zig_rotation(this->head, this->head, this->head->splayLeft);
                     return;
                 }
             }
-            if (this->head->right != nullptr)
+            if (this->head->splayRight != nullptr)
             {
-                if (this->head->right->entry->key == key) {
-                    Zag_rotation(this->head, this->head, this->head->right);
+                if (this->head->splayRight->key == key) {
+                    Zag_rotation(this->head, this->head, this->head->splayRight);
                     return;
                 }
             }
@@ -244,43 +1504,45 @@ public:
         }
         void ComplexSplay(Node* grandparent, Node* parent, Node* root, Node* child)
         {
-            if (parent->left == root && root->left == child)
+            if (parent->splayLeft == root && root->splayLeft == child)
                 Zig_Zig(grandparent, parent, root, child);
-            else if (parent->right == root && root->right == child)
+            else if (parent->splayRight == root && root->splayRight == child)
                 Zag_Zag(grandparent, parent, root, child);
-            else if (parent->right == root && root->left == child)
+            else if (parent->splayRight == root && root->splayLeft == child)
                 Zig_Zag(grandparent, parent, root, child);
-            else if (parent->left == root && root->right == child)
+            else if (parent->splayLeft == root && root->splayRight == child)
                 Zag_Zig(grandparent, parent, root, child);
         }
         void Zig_rotation(Node* parent, Node* root, Node* child, bool straight = false)
         {
-            Node* temp = child->right;
-            child->right = root;
-            root->left = temp;
+            this->rotations++;
+            Node* temp = child->splayRight;
+            child->splayRight = root;
+            root->splayLeft = temp;
             if (root == this->head) this->head = child;
             else
             {
-                if (straight) parent->left = child;
-                else parent->right = child;
+                if (straight) parent->splayLeft = child;
+                else parent->splayRight = child;
             }
         }
         void Zag_rotation(Node* parent, Node* root, Node* child, bool straight = false)
         {
-            Node* temp = child->left;
-            child->left = root;
-            root->right = temp;
+            this->rotations++;
+            Node* temp = child->splayLeft;
+            child->splayLeft = root;
+            root->splayRight = temp;
             if (root == this->head) this->head = child;
             else
             {
-                if (straight) parent->right = child;
-                else parent->left = child;
+                if (straight) parent->splayRight = child;
+                else parent->splayLeft = child;
             }
         }
         bool checkStraight(Node* parent, Node* root, Node* child)
         {
-            if (parent->left == root && root->left == child) return true;
-            if (parent->right == root && root->right == child) return true;
+            if (parent->splayLeft == root && root->splayLeft == child) return true;
+            if (parent->splayRight == root && root->splayRight == child) return true;
             return false;
         }
         void Zig_Zag(Node* grandparent, Node* parent, Node* root, Node* child)
@@ -314,29 +1576,34 @@ public:
         Node* maxLeft(Node* parent)
         {
             if (!parent) return nullptr;
-            if (parent->left == nullptr) return nullptr;
-            if (parent->left->right == nullptr) return parent->left;
-            parent = parent->left;
-            while (parent->right->right != nullptr)
-                parent = parent->right;
+            if (parent->splayLeft == nullptr) return nullptr;
+            if (parent->splayLeft->splayRight == nullptr) return parent->splayLeft;
+            parent = parent->splayLeft;
+            while (parent->splayRight->splayRight != nullptr)
+                parent = parent->splayRight;
             return parent;
         }
         Node* minRight(Node* parent)
         {
             if (!parent) return nullptr;
-            if (parent->right == nullptr) return nullptr;
-            if (parent->right->left == nullptr) return parent->right;
-            parent = parent->right;
-            while (parent->left->left != nullptr)
-                parent = parent->left;
+            if (parent->splayRight == nullptr) return nullptr;
+            if (parent->splayRight->splayLeft == nullptr) return parent->splayRight;
+            parent = parent->splayRight;
+            while (parent->splayLeft->splayLeft != nullptr)
+                parent = parent->splayLeft;
             return parent;
         }
         bool found(K key)
         {
-            Node* temp = this->head;
-            Node* check = Search(temp, temp, temp, temp, key);
+            Node* check;
+            if (SplayPolicy::semi) check = this->semiSearch(key);
+            else
+            {
+                Node* temp = this->head; int save = 0;
+                check = Search(temp, temp, temp, temp, 0, save, key);
+            }
             if (!check) return false;
-            if (key == check->entry->key) return true;
+            if (key == check->key) return true;
             return false;
         }
         void remove(K key)
@@ -345,71 +1612,46 @@ public:
             {
                 throw "Not found";
             }
+            // Removal works on the root, so it always splays fully.
+            this->budget = -1;
             Node* root = this->head; int save = 0;
             Splaying(root, root, root, root, 0, save, key);
-            Node* ptr = this->head; Node* temp;
-            if (ptr->left == nullptr && ptr->right == nullptr)
-            {
-                delete ptr; this->head = nullptr;
-            }
-            else if (maxLeft(ptr))
-            {
-                temp = maxLeft(ptr);
-                if (temp->right == nullptr)
-                {
-                    temp->right = this->head->right;
-                    Node* t = this->head;
-                    this->head = temp;
-                    delete t; t = nullptr;
-                }
-                else
-                {
-                    save = 0;
-                    K t = temp->right->entry->key;
-                    Node* p = this->head->left;
-                    Node* m = this->head->right;
-                    delete this->head; this->head = nullptr;
-                    this->head = p;
-                    Splaying(p, p, p, p, 0, save, t);
-                    this->head->right = m;
-                }
-            }
-            else if (minRight(ptr))
+            // The key is at the root now: join its subtrees by splaying the
+            // largest key on the left up, which leaves its right link free.
+            Node* ptr = this->head;
+            Node* l = ptr->splayLeft;
+            Node* r = ptr->splayRight;
+            // Inside a BKUTree the AVL tree owns the node and frees it.
+            if (this->ownsNodes) delete ptr;
+            else ptr->splayLeft = ptr->splayRight = nullptr;
+            if (l == nullptr)
             {
-                temp = minRight(ptr);
-                if (temp->left == nullptr)
-                {
-                    temp->left = this->head->left;
-                    Node* t = this->head;
-                    this->head = temp;
-                    delete t; t = nullptr;
-                }
-                else
-                {
-                    save = 0;
-                    K t = temp->left->entry->key;
-                    Node* p = this->head->left;
-                    Node* m = this->head->right;
-                    delete this->head; this->head = nullptr;
-                    this->head = p;
-                    Splaying(p, p, p, p, 0, save, t);
-                    this->head->left = p;
-                }
+                this->head = r;
+                return;
             }
+            Node* temp = l;
+            while (temp->splayRight != nullptr)
+                temp = temp->splayRight;
+            this->head = l; save = 0;
+            Node* p = this->head;
+            Splaying(p, p, p, p, 0, save, temp->key);
+            this->head->splayRight = r;
         }
-        void Splaying(Node*& grandparent, Node*& parent, Node*& root, Node*& child, int cost, int& save, K key)
+        void Splaying(Node*& grandparent, Node*& parent, Node*& root, Node*& child, int cost, int& save, const K& key, size_t lo = 0, size_t hi = 0)
         {
             if (!child)
                 return;
-            if (key < child->entry->key)
+            size_t lcp = lo < hi ? lo : hi;
+            int cmp = KeyCompare<K>::compare(key, child->key, lcp);
+            if (cmp < 0)
             {
                 save += 1;
-                Splaying(parent, root, child, child->left, cost + 1, save, key);
+                Splaying(parent, root, child, child->splayLeft, cost + 1, save, key, lo, lcp);
             }
-            else if (key > child->entry->key)
+            else if (cmp > 0)
             {
                 save += 1;
-                Splaying(parent, root, child, child->right, cost + 1, save, key);
+                Splaying(parent, root, child, child->splayRight, cost + 1, save, key, lcp, hi);
             }
             if (cost == save)
             {
@@ -417,39 +1659,175 @@ public:
                 save -= 2;
             }
         }
+        // Unlink every key in [lo, hi] without rotating. The range hangs below
+        // the first node on the search path that falls inside it; its left
+        // and right subtrees are trimmed along one path each and the trimmed
+        // right side is hung off the maximum of the left. Nodes are not freed.
+        void cutRange(const K& lo, const K& hi)
+        {
+            // Prefix bounds of lo and of hi; a bound from further up the path
+            // is smaller, so skipping one of the two compares stays correct.
+            size_t loL = 0, loH = 0, hiL = 0, hiH = 0;
+            Node** link = &this->head;
+            while (*link)
+            {
+                if (compareWithin(lo, (*link)->key, loL, loH) > 0)
+                    link = &(*link)->splayRight;
+                else if (compareWithin(hi, (*link)->key, hiL, hiH) < 0)
+                    link = &(*link)->splayLeft;
+                else break;
+            }
+            if (!*link) return;
+            Node* left = (*link)->splayLeft;
+            Node* right = (*link)->splayRight;
+            Node** l = &left;
+            while (*l)
+            {
+                if (compareWithin(lo, (*l)->key, loL, loH) > 0) l = &(*l)->splayRight;
+                else *l = (*l)->splayLeft;
+            }
+            Node** r = &right;
+            while (*r)
+            {
+                if (compareWithin(hi, (*r)->key, hiL, hiH) < 0) r = &(*r)->splayLeft;
+                else *r = (*r)->splayRight;
+            }
+            if (!left)
+            {
+                *link = right;
+                return;
+            }
+            Node* max = left;
+            while (max->splayRight) max = max->splayRight;
+            max->splayRight = right;
+            *link = left;
+        }
         bool parentLeft(Node* root, Node* parent)
         {
-            if (parent->left == root) return true;
+            if (parent->splayLeft == root) return true;
             return false;
         }
         V search(K key)
         {
-            if (!found(key))
+            Node* ret;
+            if (SplayPolicy::semi) ret = this->semiSearch(key);
+            else
+            {
+                Node* temp = this->head; int save = 0;
+                ret = Search(temp, temp, temp, temp, 0, save, key);
+            }
+            if (!ret)
             {
                 throw "Not found";
             }
-            Node* temp = this->head;
-            return Search(temp, temp, temp, temp, key)->entry->value;
+            return ret->value;
+        }
+        Node* semiSearch(const K& key)
+        {
+            Node** link = this->descend(key);
+            Node* ret = *link;
+            if (!ret) return nullptr;
+            ret->accesses++;
+            this->budget = this->policy.budget(ret->accesses);
+            this->SemiSplaying();
+            return ret;
+        }
+        // Walk down to key, or to the empty link it belongs in, recording
+        // the links passed in path. Returns the last one.
+        Node** descend(const K& key)
+        {
+            this->path.clear();
+            Node** link = &this->head;
+            size_t lo = 0, hi = 0;
+            this->path.push_back(link);
+            while (*link)
+            {
+                size_t lcp = lo < hi ? lo : hi;
+                int cmp = KeyCompare<K>::compare(key, (*link)->key, lcp);
+                if (cmp == 0) break;
+                if (cmp < 0)
+                {
+                    hi = lcp;
+                    link = &(*link)->splayLeft;
+                }
+                else
+                {
+                    lo = lcp;
+                    link = &(*link)->splayRight;
+                }
+                this->path.push_back(link);
+            }
+            return link;
+        }
+        // Semi-splay the node at the end of path (Sleator and Tarjan). Where
+        // node, parent and grandparent lie on a straight line, only the parent
+        // is rotated up and the walk carries on from the parent; on a bend the
+        // node takes the usual double rotation. Either way the walk climbs two
+        // links per step, and links above it never change.
+        void SemiSplaying()
+        {
+            int i = (int)this->path.size() - 1;
+            while (i >= 2 && this->budget != 0)
+            {
+                if (this->budget > 0) this->budget--;
+                Node* node = *this->path[i];
+                Node* parent = *this->path[i - 1];
+                Node* grandparent = *this->path[i - 2];
+                if ((parent->splayLeft == node) == (grandparent->splayLeft == parent))
+                    *this->path[i - 2] = rotateUp(grandparent, parent);
+                else
+                {
+                    *this->path[i - 1] = rotateUp(parent, node);
+                    *this->path[i - 2] = rotateUp(grandparent, node);
+                }
+                i -= 2;
+            }
+        }
+        // Rotate child above parent; returns child for the caller to link in.
+        Node* rotateUp(Node* parent, Node* child)
+        {
+            this->rotations++;
+            if (parent->splayLeft == child)
+            {
+                parent->splayLeft = child->splayRight;
+                child->splayRight = parent;
+            }
+            else
+            {
+                parent->splayRight = child->splayLeft;
+                child->splayLeft = parent;
+            }
+            return child;
         }
-        Node* Search(Node*& grandparent, Node*& parent, Node*& root, Node*& child, K key)
+        // Splays a hit bottom-up like Splaying, one step per two levels, for
+        // as many steps as the policy's budget allows. A miss splays nothing.
+        Node* Search(Node*& grandparent, Node*& parent, Node*& root, Node*& child, int cost, int& save, const K& key, size_t lo = 0, size_t hi = 0)
         {
             if (!child) return nullptr;
-            if (child->entry->key == key)
+            Node* ret;
+            size_t lcp = lo < hi ? lo : hi;
+            int cmp = KeyCompare<K>::compare(key, child->key, lcp);
+            if (cmp == 0)
             {
-                Node* temp = child;
-                Splay(grandparent, parent, root, child, key);
-                return temp;
+                ret = child;
+                child->accesses++;
+                this->budget = this->policy.budget(child->accesses);
             }
-            if (key < child->entry->key)
+            else
             {
-                return Search(parent, root, child, child->left, key);
+                save += 1;
+                if (cmp < 0)
+                    ret = Search(parent, root, child, child->splayLeft, cost + 1, save, key, lo, lcp);
+                else
+                    ret = Search(parent, root, child, child->splayRight, cost + 1, save, key, lcp, hi);
+                if (!ret) return nullptr;
             }
-            else if (key > child->entry->key)
+            if (cost == save)
             {
-                return Search(parent, root, child, child->right, key);
+                Splay(grandparent, parent, root, child, key);
+                save -= 2;
             }
-
-            return nullptr;
+            return ret;
         }
         void traverseNLR(void (*func)(K key, V value))
         {
@@ -461,16 +1839,46 @@ public:
             if (!ptr) return;
             else
             {
-                func(ptr->entry->key, ptr->entry->value);
-                traverseNLR(ptr->left, func);
-                traverseNLR(ptr->right, func);
+                func(ptr->key, ptr->value);
+                traverseNLR(ptr->splayLeft, func);
+                traverseNLR(ptr->splayRight, func);
+            }
+        }
+        // Nodes on the longest path down from the root, 0 when empty.
+        int height()
+        {
+            return height(this->head);
+        }
+        int height(Node* root)
+        {
+            if (!root) return 0;
+            int l = height(root->splayLeft);
+            int r = height(root->splayRight);
+            return (l > r ? l : r) + 1;
+        }
+        // Links from the root down to key, or -1 when it is absent. Does not splay.
+        int depth(const K& key)
+        {
+            int ret = 0;
+            size_t lo = 0, hi = 0;
+            for (Node* root = this->head; root; ret++)
+            {
+                int cmp = compareWithin(key, root->key, lo, hi);
+                if (cmp == 0) return ret;
+                root = cmp < 0 ? root->splayLeft : root->splayRight;
             }
+            return -1;
         }
         void clear()
         {
+            if (!this->ownsNodes)
+            {
+                this->head = nullptr;
+                return;
+            }
             Node* temp = this->head;
             while (temp != nullptr) {
-                remove(temp->entry->key);
+                remove(temp->key);
                 temp = this->head;
             }
         }
@@ -478,37 +1886,110 @@ public:
 
     class AVLTree {
     public:
-        class Node {
-            Entry* entry;
-            Node* left;
-            Node* right;
-            int balance;
-            int hL;
-            int hR;
+        typedef typename BKUTree::Node Node;
+
+        // Immutable node of the persistent (path-copying) version of the tree.
+        // Nodes are shared between versions and freed when the last one drops.
+        class PNode {
+            K key;
+            V value;
+            PNode* left;
+            PNode* right;
+            int height;
+            atomic<int> refs;
             friend class AVLTree;
-            friend class BKUTree;
-            typename SplayTree::Node* corr;
+            friend class Snapshot;
 
-            Node(Entry* entry = NULL, Node* left = NULL, Node* right = NULL) {
-                this->entry = entry;
+            PNode(K key, V value, PNode* left, PNode* right) : key(key), value(value) {
                 this->left = left;
                 this->right = right;
-                this->balance = 0;
-                this->hL = 0;
-                this->hR = 0;
-                this->corr = NULL;
+                int hl = left ? left->height : 0;
+                int hr = right ? right->height : 0;
+                this->height = (hl > hr ? hl : hr) + 1;
+                this->refs = 1;
+            }
+        };
+
+        // Read-only view of the tree as it was when snapshot() was called.
+        class Snapshot {
+            PNode* root;
+            friend class AVLTree;
+
+            Snapshot(PNode* root) : root(root) {}
+        public:
+            Snapshot(const Snapshot& other) : root(other.root) { retain(this->root); }
+            Snapshot& operator=(const Snapshot& other)
+            {
+                retain(other.root);
+                release(this->root);
+                this->root = other.root;
+                return *this;
+            }
+            ~Snapshot() { release(this->root); }
+
+            bool found(K key)
+            {
+                return Search(key, this->root) != nullptr;
+            }
+            V search(K key)
+            {
+                PNode* ret = Search(key, this->root);
+                if (!ret)
+                {
+                    throw "Not found";
+                }
+                return ret->value;
+            }
+            PNode* Search(K key, PNode* root)
+            {
+                size_t lo = 0, hi = 0;
+                while (root)
+                {
+                    int cmp = compareWithin(key, root->key, lo, hi);
+                    if (cmp == 0) return root;
+                    root = cmp < 0 ? root->left : root->right;
+                }
+                return nullptr;
+            }
+            void traverseNLR(void (*func)(K key, V value))
+            {
+                traverseNLR(this->root, func);
+            }
+            // In-order walk that accepts any callable, e.g. a capturing lambda.
+            template <class F>
+            void forEach(F func)
+            {
+                forEach(this->root, func);
+            }
+            template <class F>
+            void forEach(PNode* ptr, F& func)
+            {
+                if (!ptr) return;
+                forEach(ptr->left, func);
+                func(ptr->key, ptr->value);
+                forEach(ptr->right, func);
+            }
+            void traverseNLR(PNode* ptr, void (*func)(K key, V value))
+            {
+                if (!ptr) return;
+                func(ptr->key, ptr->value);
+                traverseNLR(ptr->left, func);
+                traverseNLR(ptr->right, func);
             }
         };
 
     public:
         Node* head;
-        Node* recentNode;
+        bool persistent;
+        PNode* proot;
+        mutex rootLock;
         friend class SplayTree;
         friend class BKUTree;
         AVLTree() : head(NULL)
         {
             this->head = new Node();
-            this->recentNode = new Node();
+            this->persistent = false;
+            this->proot = nullptr;
         }
         ~AVLTree() { this->clear(); };
 
@@ -518,48 +1999,48 @@ public:
             {
                 throw "Duplicate key";
             }
-            Entry* entry = new Entry(key, value);
-            add(entry);
+            add(new Node(key, value));
         }
-        void add(Entry* entry)
+        void add(Node* node)
         {
-            if (found(entry->key))
+            if (found(node->key))
             {
                 throw "Duplicate key";
             }
             bool h = false;
             Node* temp = this->head;
-            Add(temp->left, entry, temp, h);
+            Add(temp->left, node, temp, h);
+            if (this->persistent)
+                publish(PAdd(this->proot, node->key, node->value));
         }
-        void Add(Node*& root, Entry* entry, Node*& parent, bool& h)
+        void Add(Node*& root, Node* node, Node*& parent, bool& h, size_t lo = 0, size_t hi = 0)
         {
             if (this->head->left == nullptr)
             {
-                this->head->left = new Node(entry, NULL, NULL);
-                this->recentNode = this->head->left;
+                this->head->left = node;
                 return;
             }
             if (!root)
             {
-                root = new Node(entry, NULL, NULL);
-                this->recentNode = root;
+                root = node;
             }
-            if (entry->key < root->entry->key)
+            size_t lcp = lo < hi ? lo : hi;
+            int cmp = KeyCompare<K>::compare(node->key, root->key, lcp);
+            if (cmp < 0)
             {
                 root->hL += 1;
-                Add(root->left, entry, root, h);
+                Add(root->left, node, root, h, lo, lcp);
             }
-            else if (entry->key > root->entry->key)
+            else if (cmp > 0)
             {
                 root->hR += 1;
-                Add(root->right, entry, root, h);
+                Add(root->right, node, root, h, lcp, hi);
             }
             edit(parent, root, h);
         }
         void edit(Node* parent, Node* root, bool& h)
         {
-            if (h)
-                calc_height(root);
+            calc_height(root);
             if (root->hL - root->hR > 1)
             {
                 Node* child = root->left;
@@ -604,6 +2085,11 @@ public:
                     count = b->hR;
                 temp->hR = count + 1;
             }
+            temp->size = 1 + size(a) + size(b);
+        }
+        static int size(Node* node)
+        {
+            return node ? node->size : 0;
         }
         void LL_case(Node* parent, Node* root, Node* child)
         {
@@ -680,25 +2166,28 @@ public:
         }
         void remove(K key)
         {
-            if (!found(key))
+            bool h = false;
+            Node* temp = this->head;
+            if (!Remove(temp->left, key, temp, h))
             {
                 throw "Not found";
             }
-            bool h = false;
-            Node* temp = this->head;
-            Remove(temp->left, key, temp, h);
+            if (this->persistent)
+                publish(PRemove(this->proot, key));
         }
-        void Remove(Node* root, K key, Node* parent, bool& h)
+        // False when key is not in the tree, which is then left untouched.
+        bool Remove(Node* root, K key, Node* parent, bool& h, size_t lo = 0, size_t hi = 0)
         {
-            if (this->head->left == nullptr) return;
-            if (!root) return;
-            if (key < root->entry->key)
+            if (this->head->left == nullptr) return false;
+            if (!root) return false;
+            int cmp = compareWithin(key, root->key, lo, hi);
+            if (cmp < 0)
             {
-                Remove(root->left, key, root, h);
+                return Remove(root->left, key, root, h, lo, hi);
             }
-            else if (key > root->entry->key)
+            else if (cmp > 0)
             {
-                Remove(root->right, key, root, h);
+                return Remove(root->right, key, root, h, lo, hi);
             }
             else
             {
@@ -759,9 +2248,9 @@ public:
                         temp->left = t;
                     }
                 }
-                delete root->entry;
                 delete root;
                 Edit(this->head->left, temp, this->head, h);
+                return true;
             }
         }
         bool parentLeft(Node* root, Node* parent)
@@ -769,19 +2258,19 @@ public:
             if (parent->left == root) return true;
             return false;
         }
-        void Edit(Node* root, Node* temp, Node* parent, bool& h)
+        void Edit(Node* root, Node* temp, Node* parent, bool& h, size_t lo = 0, size_t hi = 0)
         {
             if (!root) return;
-            if (temp->entry->key < root->entry->key)
+            int cmp = compareWithin(temp->key, root->key, lo, hi);
+            if (cmp < 0)
             {
-                Edit(root->left, temp, root, h);
+                Edit(root->left, temp, root, h, lo, hi);
             }
-            else if (temp->entry->key > root->entry->key)
+            else if (cmp > 0)
             {
-                Edit(root->right, temp, root, h);
+                Edit(root->right, temp, root, h, lo, hi);
             }
-            if (h)
-                calc_height(root);
+            calc_height(root);
             if (root->hL - root->hR > 1)
             {
                 Node* child = root->left;
@@ -808,60 +2297,145 @@ public:
                 throw "Not found";
             }
             Node* temp = this->head->left;
-            return Search(key, temp)->entry->value;
+            return Search(key, temp)->value;
         }
-        bool found(K key)
+        // Look up n keys at once, group of them in flight. Each step moves one
+        // lookup down a level and prefetches its next node, then switches to
+        // the next lookup, so the cache misses of the group overlap.
+        void multiSearch(const K* keys, int n, Node** out, int group)
         {
-            Node* temp = this->head->left;
-            Node* check = Search(key, temp);
-            if (!check) return false;
-            if (key == check->entry->key) return true;
-            return false;
-        }
-        Node* SearchBKU(K key, Node* root, vector<K>& traversedList)
-        {
-            if (!root) return nullptr;
-            if (key == root->entry->key) return root;
-            if (key < root->entry->key)
+            if (group < 1) group = 1;
+            vector<int> index(group, -1);
+            vector<Node*> cursor(group);
+            vector<size_t> lo(group, 0), hi(group, 0);
+            int next = 0, active = 0;
+            for (int i = 0; i < group && next < n; i++)
             {
-                traversedList.push_back(root->entry->key);
-                return SearchBKU(key, root->left, traversedList);
+                index[i] = next++;
+                cursor[i] = this->head->left;
+                BKU_PREFETCH(cursor[i]);
+                active++;
             }
-            else if (key > root->entry->key)
+            while (active > 0)
             {
-                traversedList.push_back(root->entry->key);
-                return SearchBKU(key, root->right, traversedList);
+                for (int i = 0; i < group; i++)
+                {
+                    if (index[i] < 0) continue;
+                    Node* root = cursor[i];
+                    const K& key = keys[index[i]];
+                    int cmp = root ? compareWithin(key, root->key, lo[i], hi[i]) : 0;
+                    if (cmp != 0)
+                    {
+                        cursor[i] = cmp < 0 ? root->left : root->right;
+                        BKU_PREFETCH(cursor[i]);
+                        continue;
+                    }
+                    out[index[i]] = root;
+                    if (next < n)
+                    {
+                        index[i] = next++;
+                        cursor[i] = this->head->left;
+                        lo[i] = hi[i] = 0;
+                    }
+                    else
+                    {
+                        index[i] = -1;
+                        active--;
+                    }
+                }
             }
         }
-        Node* searchBKU(K key, Node* root, Node* brk, vector<K>& traversedList)
+        // Number of keys below key, or up to and including it when inclusive.
+        int rank(K key, bool inclusive = false)
         {
-            if (root == brk) return nullptr;
-            if (!root) return nullptr;
-            if (key == root->entry->key) return root;
-            if (key < root->entry->key)
+            int ret = 0;
+            size_t lo = 0, hi = 0;
+            Node* root = this->head->left;
+            while (root)
             {
-                traversedList.push_back(root->entry->key);
-                return Search(key, root->left);
+                int cmp = compareWithin(key, root->key, lo, hi);
+                if (cmp < 0 || (!inclusive && cmp == 0))
+                    root = root->left;
+                else
+                {
+                    ret += size(root->left) + 1;
+                    if (cmp == 0) break;
+                    root = root->right;
+                }
             }
-            else if (key > root->entry->key)
+            return ret;
+        }
+        // The k-th smallest node, counting from 0.
+        Node* select(int k)
+        {
+            Node* root = this->head->left;
+            while (root)
             {
-                traversedList.push_back(root->entry->key);
-                return Search(key, root->right);
+                int left = size(root->left);
+                if (k < left) root = root->left;
+                else if (k == left) return root;
+                else
+                {
+                    k -= left + 1;
+                    root = root->right;
+                }
             }
+            return nullptr;
+        }
+        bool found(K key)
+        {
+            Node* temp = this->head->left;
+            Node* check = Search(key, temp);
+            if (!check) return false;
+            if (key == check->key) return true;
+            return false;
         }
-        Node* Search(K key, Node* root)
+        Node* SearchBKU(const K& key, Node* root, vector<K>& traversedList, size_t lo = 0, size_t hi = 0)
         {
             if (!root) return nullptr;
-            if (key == root->entry->key) return root;
-            if (key < root->entry->key)
-            {
-                return Search(key, root->left);
-            }
-            else if (key > root->entry->key)
+            size_t lcp = lo < hi ? lo : hi;
+            int cmp = KeyCompare<K>::compare(key, root->key, lcp);
+            if (cmp == 0) return root;
+            traversedList.push_back(root->key);
+            if (cmp < 0)
+                return SearchBKU(key, root->left, traversedList, lo, lcp);
+            else
+                return SearchBKU(key, root->right, traversedList, lcp, hi);
+        }
+        Node* searchBKU(const K& key, Node* root, Node* brk, vector<K>& traversedList)
+        {
+            if (root == brk) return nullptr;
+            if (!root) return nullptr;
+            size_t lcp = 0;
+            int cmp = KeyCompare<K>::compare(key, root->key, lcp);
+            if (cmp == 0) return root;
+            traversedList.push_back(root->key);
+            if (cmp < 0)
+                return Search(key, root->left, 0, lcp);
+            else
+                return Search(key, root->right, lcp, 0);
+        }
+        // lo and hi are the prefix lengths key shares with the nearest
+        // ancestors it went right and left from. Every key in the current
+        // subtree lies between those two, so it shares at least the smaller.
+        Node* Search(const K& key, Node* root, size_t lo = 0, size_t hi = 0)
+        {
+            while (root)
             {
-                return Search(key, root->right);
+                size_t lcp = lo < hi ? lo : hi;
+                int cmp = KeyCompare<K>::compare(key, root->key, lcp);
+                if (cmp == 0) return root;
+                if (cmp < 0)
+                {
+                    hi = lcp;
+                    root = root->left;
+                }
+                else
+                {
+                    lo = lcp;
+                    root = root->right;
+                }
             }
-
             return nullptr;
         }
         void traverseNLR(void (*func)(K key, V value))
@@ -874,25 +2448,542 @@ public:
             if (!ptr) return;
             else
             {
-                func(ptr->entry->key, ptr->entry->value);
+                func(ptr->key, ptr->value);
                 traverseNLR(ptr->left, func);
                 traverseNLR(ptr->right, func);
             }
         }
+        // Switch on path copying. Every later add/remove copies only the
+        // O(log n) nodes on its path, so snapshot() is a refcount bump.
+        void enablePersistence()
+        {
+            if (this->persistent) return;
+            vector<Node*> nodes;
+            Inorder(this->head->left, nodes);
+            this->persistent = true;
+            publish(Build(nodes, 0, (int)nodes.size() - 1));
+        }
+        void disablePersistence()
+        {
+            if (!this->persistent) return;
+            this->persistent = false;
+            publish(nullptr);
+        }
+        Snapshot snapshot()
+        {
+            lock_guard<mutex> lock(this->rootLock);
+            retain(this->proot);
+            return Snapshot(this->proot);
+        }
+        void publish(PNode* root)
+        {
+            PNode* old;
+            {
+                lock_guard<mutex> lock(this->rootLock);
+                old = this->proot;
+                this->proot = root;
+            }
+            release(old);
+        }
+        // Balanced PNode tree over the sorted nodes in O(n).
+        PNode* Build(vector<Node*>& nodes, int lo, int hi)
+        {
+            if (lo > hi) return nullptr;
+            int mid = lo + (hi - lo) / 2;
+            PNode* left = Build(nodes, lo, mid - 1);
+            PNode* right = Build(nodes, mid + 1, hi);
+            return new PNode(nodes[mid]->key, nodes[mid]->value, left, right);
+        }
+        void Inorder(Node* root, vector<Node*>& nodes)
+        {
+            if (!root) return;
+            Inorder(root->left, nodes);
+            nodes.push_back(root);
+            Inorder(root->right, nodes);
+        }
+
+        // Split out every key in [lo, hi] as its own subtree and join the
+        // rest back together, in O(log n).
+        Node* cutRange(const K& lo, const K& hi)
+        {
+            Node *l, *rest, *range, *r;
+            split(this->head->left, lo, false, l, rest);
+            split(rest, hi, true, range, r);
+            this->head->left = join(l, r);
+            return range;
+        }
+        // l gets the keys below key (up to and including it when inclusive),
+        // r the others.
+        void split(Node* root, const K& key, bool inclusive, Node*& l, Node*& r, size_t lo = 0, size_t hi = 0)
+        {
+            if (!root)
+            {
+                l = r = nullptr;
+                return;
+            }
+            Node* left = root->left;
+            Node* right = root->right;
+            Node* middle;
+            int cmp = compareWithin(key, root->key, lo, hi);
+            if (cmp > 0 || (inclusive && cmp == 0))
+            {
+                split(right, key, inclusive, middle, r, lo, hi);
+                l = join(left, root, middle);
+            }
+            else
+            {
+                split(left, key, inclusive, l, middle, lo, hi);
+                r = join(middle, root, right);
+            }
+        }
+        // Every key in l is below every key in r.
+        Node* join(Node* l, Node* r)
+        {
+            if (!l) return r;
+            if (!r) return l;
+            Node* min;
+            Node* rest = removeMin(r, min);
+            return join(l, min, rest);
+        }
+        Node* removeMin(Node* root, Node*& min)
+        {
+            if (!root->left)
+            {
+                min = root;
+                return root->right;
+            }
+            Node* rest = removeMin(root->left, min);
+            return join(rest, root, root->right);
+        }
+        // l < mid < r with any heights. Descends the taller side until the
+        // heights match, in O(|height(l) - height(r)| + 1).
+        Node* join(Node* l, Node* mid, Node* r)
+        {
+            if (height(l) > height(r) + 1)
+            {
+                l->right = join(l->right, mid, r);
+                return rebalance(l);
+            }
+            if (height(r) > height(l) + 1)
+            {
+                r->left = join(l, mid, r->left);
+                return rebalance(r);
+            }
+            mid->left = l;
+            mid->right = r;
+            calc_height(mid);
+            return mid;
+        }
+        static int height(Node* root)
+        {
+            if (!root) return 0;
+            return (root->hL > root->hR ? root->hL : root->hR) + 1;
+        }
+        Node* rebalance(Node* root)
+        {
+            calc_height(root);
+            if (root->hL - root->hR > 1)
+            {
+                if (height(root->left->left) < height(root->left->right))
+                    root->left = rotateLeft(root->left);
+                return rotateRight(root);
+            }
+            if (root->hR - root->hL > 1)
+            {
+                if (height(root->right->right) < height(root->right->left))
+                    root->right = rotateRight(root->right);
+                return rotateLeft(root);
+            }
+            return root;
+        }
+        Node* rotateLeft(Node* root)
+        {
+            Node* child = root->right;
+            root->right = child->left;
+            calc_height(root);
+            child->left = root;
+            calc_height(child);
+            return child;
+        }
+        Node* rotateRight(Node* root)
+        {
+            Node* child = root->left;
+            root->left = child->right;
+            calc_height(root);
+            child->right = root;
+            calc_height(child);
+            return child;
+        }
+        static void retain(PNode* node)
+        {
+            if (node) node->refs.fetch_add(1);
+        }
+        static void release(PNode* node)
+        {
+            if (node && node->refs.fetch_sub(1) == 1)
+            {
+                release(node->left);
+                release(node->right);
+                delete node;
+            }
+        }
+        static int pheight(PNode* node)
+        {
+            return node ? node->height : 0;
+        }
+        // The P* helpers borrow their tree argument and return a new reference;
+        // Balance takes ownership of left and right.
+        PNode* Balance(K key, V value, PNode* left, PNode* right)
+        {
+            if (pheight(left) - pheight(right) > 1)
+            {
+                PNode* ret;
+                if (pheight(left->left) >= pheight(left->right))
+                {
+                    retain(left->left); retain(left->right);
+                    ret = new PNode(left->key, left->value, left->left,
+                        new PNode(key, value, left->right, right));
+                }
+                else
+                {
+                    PNode* s_child = left->right;
+                    retain(left->left); retain(s_child->left); retain(s_child->right);
+                    ret = new PNode(s_child->key, s_child->value,
+                        new PNode(left->key, left->value, left->left, s_child->left),
+                        new PNode(key, value, s_child->right, right));
+                }
+                release(left);
+                return ret;
+            }
+            if (pheight(right) - pheight(left) > 1)
+            {
+                PNode* ret;
+                if (pheight(right->right) >= pheight(right->left))
+                {
+                    retain(right->left); retain(right->right);
+                    ret = new PNode(right->key, right->value,
+                        new PNode(key, value, left, right->left), right->right);
+                }
+                else
+                {
+                    PNode* s_child = right->left;
+                    retain(right->right); retain(s_child->left); retain(s_child->right);
+                    ret = new PNode(s_child->key, s_child->value,
+                        new PNode(key, value, left, s_child->left),
+                        new PNode(right->key, right->value, s_child->right, right->right));
+                }
+                release(right);
+                return ret;
+            }
+            return new PNode(key, value, left, right);
+        }
+        PNode* PAdd(PNode* root, K key, V value, size_t lo = 0, size_t hi = 0)
+        {
+            if (!root) return new PNode(key, value, nullptr, nullptr);
+            if (compareWithin(key, root->key, lo, hi) < 0)
+            {
+                retain(root->right);
+                return Balance(root->key, root->value, PAdd(root->left, key, value, lo, hi), root->right);
+            }
+            retain(root->left);
+            return Balance(root->key, root->value, root->left, PAdd(root->right, key, value, lo, hi));
+        }
+        PNode* PRemove(PNode* root, K key, size_t lo = 0, size_t hi = 0)
+        {
+            if (!root) return nullptr;
+            int cmp = compareWithin(key, root->key, lo, hi);
+            if (cmp < 0)
+            {
+                retain(root->right);
+                return Balance(root->key, root->value, PRemove(root->left, key, lo, hi), root->right);
+            }
+            if (cmp > 0)
+            {
+                retain(root->left);
+                return Balance(root->key, root->value, root->left, PRemove(root->right, key, lo, hi));
+            }
+            if (!root->left) { retain(root->right); return root->right; }
+            if (!root->right) { retain(root->left); return root->left; }
+            PNode* min = root->right;
+            while (min->left) min = min->left;
+            retain(root->left);
+            return Balance(min->key, min->value, root->left, PRemoveMin(root->right));
+        }
+        PNode* PRemoveMin(PNode* root)
+        {
+            if (!root->left) { retain(root->right); return root->right; }
+            retain(root->right);
+            return Balance(root->key, root->value, PRemoveMin(root->left), root->right);
+        }
+
         void clear()
         {
+            if (!this->head) return;
+            this->persistent = false;
+            publish(nullptr);
             Node* temp = this->head->left;
             while (temp != nullptr) {
-                remove(temp->entry->key);
+                remove(temp->key);
                 temp = this->head->left;
             }
-            delete this->recentNode;
             delete this->head;
             this->head = nullptr;
-            this->recentNode = nullptr;
         }
     };
 };
+// Rotations per operation and latency of each splay policy on a uniform and
+// a skewed workload. Run with "bench" as the first argument.
+template <class SplayPolicy>
+void bench_splay(const char* name, int n, int ops)
+{
+    for (int skewed = 0; skewed < 2; skewed++)
+    {
+        typename BKUTree<int, int, SplayPolicy>::SplayTree* tree = new typename BKUTree<int, int, SplayPolicy>::SplayTree();
+        mt19937 rng(42);
+        vector<int> keys;
+        for (int i = 0; i < n; i++) keys.push_back(i);
+        shuffle(keys.begin(), keys.end(), rng);
+        for (int i = 0; i < n; i++) tree->add(keys[i], keys[i]);
+        vector<int> probes;
+        for (int i = 0; i < ops; i++)
+        {
+            // Skewed: 90% of the accesses go to 1% of the keys.
+            if (skewed && rng() % 10 != 0) probes.push_back(keys[rng() % (n / 100 + 1)]);
+            else probes.push_back(keys[rng() % n]);
+        }
+        tree->rotations = 0;
+        long sum = 0;
+        auto start = chrono::steady_clock::now();
+        for (int i = 0; i < ops; i++) sum += tree->search(probes[i]);
+        auto end = chrono::steady_clock::now();
+        double ns = chrono::duration<double, nano>(end - start).count() / ops;
+        cout << name << (skewed ? " skewed " : " uniform ") << "rotations/op " << (double)tree->rotations / ops
+             << " ns/op " << ns << (sum == -1 ? "!" : "") << endl;
+    }
+}
+// One AVL lookup at a time against searchMany at several group sizes, on a
+// tree inserted in random order so its nodes are scattered over the heap.
+void bench_lookup(int n, int ops)
+{
+    BKUTree<int, int>* tree = new BKUTree<int, int>();
+    mt19937 rng(42);
+    vector<int> keys;
+    for (int i = 0; i < n; i++) keys.push_back(i * 2);
+    shuffle(keys.begin(), keys.end(), rng);
+    for (int i = 0; i < n; i++) tree->add(keys[i], i);
+    vector<int> probes;
+    for (int i = 0; i < ops; i++) probes.push_back(rng() % (2 * n));
+    long sum = 0;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < ops; i++) sum += tree->avl->found(probes[i]);
+    auto end = chrono::steady_clock::now();
+    cout << "lookup single ns/op " << chrono::duration<double, nano>(end - start).count() / ops << endl;
+    vector<int*> values;
+    for (int group = 4; group <= 32; group *= 2)
+    {
+        start = chrono::steady_clock::now();
+        tree->searchMany(probes, values, group);
+        end = chrono::steady_clock::now();
+        for (int i = 0; i < ops; i++) sum += values[i] != nullptr;
+        cout << "lookup group " << group << " ns/op " << chrono::duration<double, nano>(end - start).count() / ops << endl;
+    }
+    cout << "lookup hits " << sum << endl;
+}
+void bench()
+{
+    int n = 20000, ops = 200000;
+    bench_splay<AlwaysSplay>("always", n, ops);
+    bench_splay<EveryKthSplay<4> >("every-4th", n, ops);
+    bench_splay<ThresholdSplay<8> >("threshold-8", n, ops);
+    bench_splay<SemiSplay>("semi", n, ops);
+    bench_lookup(2000000, 2000000);
+}
+
+// BKUTree over interned string keys. Keys are copied into the tree's own
+// StringArena once on add and handed back when the last copy of the key is
+// gone; lookups take string_view and reject strings that were never interned
+// before touching either tree.
+template <class V, class SplayPolicy = AlwaysSplay>
+class StringBKUTree : public BKUTree<ArenaKey, V, SplayPolicy> {
+public:
+    typedef BKUTree<ArenaKey, V, SplayPolicy> Base;
+    using Base::add;
+    using Base::remove;
+    using Base::search;
+    StringArena* arena;
+
+    StringBKUTree(int maxNumOfKeys = 5) : Base(maxNumOfKeys)
+    {
+        this->arena = new StringArena();
+        StringArena* arena = this->arena;
+        // Replayed and loaded keys are interned into this tree's arena.
+        this->readKey = [arena](FILE* in, ArenaKey& key) {
+            string str;
+            if (!Serializer<string>::read(in, str)) return false;
+            key = arena->intern(str);
+            return true;
+        };
+    }
+    ~StringBKUTree() { this->arena->detach(); }
+
+    void add(string_view key, V value)
+    {
+        Base::add(this->arena->intern(key), value);
+    }
+    void remove(string_view key)
+    {
+        ArenaKey handle;
+        if (!this->arena->lookup(key, handle))
+        {
+            throw "Not found";
+        }
+        Base::remove(handle);
+    }
+    V search(string_view key, vector<ArenaKey>& traversedList)
+    {
+        ArenaKey handle;
+        if (!this->arena->lookup(key, handle))
+        {
+            throw "Not found";
+        }
+        return Base::search(handle, traversedList);
+    }
+    // Keys come back interned into this tree's arena, so the records can be
+    // replayed against it.
+    vector<typename Base::TraceRecord> loadTrace(const string& path)
+    {
+        return Base::loadTrace(path, this->readKey);
+    }
+    // Chunks, free slots and the intern table. The live slots are also
+    // counted per key in memoryUsage().payload.
+    size_t arenaMemory()
+    {
+        return this->arena->memory();
+    }
+};
+
+class ReplayReport {
+public:
+    long ops;
+    long errors;
+    double seconds;
+    double p50, p99, p999;
+    long searchPaths[NUM_SEARCH_PATHS];
+    void print()
+    {
+        const char* names[NUM_SEARCH_PATHS] = {"splay root", "keys window", "finger", "root fallback", "miss"};
+        cout << ops << " ops in " << seconds << " s, " << errors << " errors" << endl;
+        cout << "latency ns p50 " << p50 << " p99 " << p99 << " p99.9 " << p999 << endl;
+        for (int i = 0; i < NUM_SEARCH_PATHS; i++) cout << names[i] << ": " << searchPaths[i] << endl;
+    }
+};
+
+// Run a recorded trace against tree. With rate > 0 operations are issued
+// open-loop at rate ops/s and latency counts from the scheduled start, so a
+// stall shows up in the ops queued behind it; rate == 0 runs closed-loop.
+// With timeScale > 0 each operation is instead issued at its recorded time
+// times timeScale (1 keeps the original pacing, 0.5 runs twice as fast),
+// which needs a trace recorded with timestamps.
+template <class K, class V, class SplayPolicy>
+ReplayReport replayTrace(BKUTree<K, V, SplayPolicy>& tree, vector<typename BKUTree<K, V, SplayPolicy>::TraceRecord>& records, double rate = 0, double timeScale = 0)
+{
+    if (timeScale > 0 && !records.empty() && records.back().time == 0)
+    {
+        throw "Trace has no timestamps";
+    }
+    ReplayReport report;
+    report.ops = records.size();
+    report.errors = 0;
+    tree.resetSearchPaths();
+    vector<double> latencies;
+    vector<K> traversedList;
+    auto start = chrono::steady_clock::now();
+    for (size_t i = 0; i < records.size(); i++)
+    {
+        auto issued = chrono::steady_clock::now();
+        if (timeScale > 0 || rate > 0)
+        {
+            double offset = timeScale > 0 ? (records[i].time - records[0].time) * timeScale / 1e9 : i / rate;
+            issued = start + chrono::duration_cast<chrono::steady_clock::duration>(chrono::duration<double>(offset));
+            // Sleep through long gaps, spin the last stretch.
+            if (issued - chrono::steady_clock::now() > chrono::milliseconds(2))
+                this_thread::sleep_until(issued - chrono::milliseconds(1));
+            while (chrono::steady_clock::now() < issued);
+        }
+        try
+        {
+            if (records[i].op == 'A') tree.add(records[i].key, records[i].value);
+            else if (records[i].op == 'R') tree.remove(records[i].key);
+            else
+            {
+                traversedList.clear();
+                tree.search(records[i].key, traversedList);
+            }
+        }
+        catch (const char*)
+        {
+            report.errors++;
+        }
+        latencies.push_back(chrono::duration<double, nano>(chrono::steady_clock::now() - issued).count());
+    }
+    report.seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    sort(latencies.begin(), latencies.end());
+    size_t n = latencies.size();
+    report.p50 = n ? latencies[(size_t)(n * 0.5)] : 0;
+    report.p99 = n ? latencies[min(n - 1, (size_t)(n * 0.99))] : 0;
+    report.p999 = n ? latencies[min(n - 1, (size_t)(n * 0.999))] : 0;
+    for (int i = 0; i < NUM_SEARCH_PATHS; i++) report.searchPaths[i] = tree.searchPaths[i];
+    return report;
+}
+
+// "record <file> <ops>" writes a sample skewed int trace; "replay <file>
+// [rate | xSCALE] [maxNumOfKeys]" replays one and prints the report, at rate
+// ops/s or at the recorded times scaled by SCALE ("x1" as recorded). Returns
+// the exit status.
+int traceTool(int argc, char** argv)
+{
+    bool record = strcmp(argv[1], "record") == 0;
+    if ((record && (argc != 4 || atoi(argv[3]) <= 0)) || (!record && (argc < 3 || argc > 5)))
+    {
+        cerr << "usage: " << argv[0] << " record <file> <ops>" << endl;
+        cerr << "       " << argv[0] << " replay <file> [rate | xSCALE] [maxNumOfKeys]" << endl;
+        return 2;
+    }
+    if (record)
+    {
+        BKUTree<int, int> tree;
+        tree.startTrace(true);
+        mt19937 rng(7);
+        int ops = atoi(argv[3]);
+        vector<int> traversedList;
+        for (int i = 0; i < ops; i++)
+        {
+            int key = rng() % 10 ? rng() % 100 : rng() % 100000;
+            try
+            {
+                int op = rng() % 10;
+                if (op < 2) tree.add(key, i);
+                else if (op < 3) tree.remove(key);
+                else tree.search(key, traversedList);
+            }
+            catch (const char*) {}
+            traversedList.clear();
+        }
+        vector<BKUTree<int, int>::TraceRecord> records = tree.stopTrace();
+        BKUTree<int, int>::saveTrace(argv[2], records);
+    }
+    else
+    {
+        vector<BKUTree<int, int>::TraceRecord> records = BKUTree<int, int>::loadTrace(argv[2]);
+        double rate = 0, timeScale = 0;
+        if (argc > 3 && argv[3][0] == 'x') timeScale = atof(argv[3] + 1);
+        else if (argc > 3) rate = atof(argv[3]);
+        BKUTree<int, int> tree(argc > 4 ? atoi(argv[4]) : 5);
+        replayTrace(tree, records, rate, timeScale).print();
+    }
+    return 0;
+}
+
 void printKey(int key, int value) {
      cout << key << endl;
 }
@@ -911,9 +3002,513 @@ void test_2()
     for (int i = 0; i < 7; i++) tree->add(keys[i], keys[i]);
     tree->traverseNLROnSplay(printKey);
 }
-int main()
+int failures = 0;
+void check(const char* test, bool ok, const char* what)
+{
+    if (!ok)
+    {
+        cout << test << ": FAIL " << what << endl;
+        failures++;
+    }
+}
+
+// A snapshot keeps showing the tree as it was while the tree moves on.
+void test_3()
+{
+    BKUTree<int, int> tree;
+    for (int i = 0; i < 100; i++) tree.add(i, i);
+    tree.enableSnapshots();
+    BKUTree<int, int>::AVLTree::Snapshot before = tree.snapshot();
+    for (int i = 0; i < 100; i += 2) tree.remove(i);
+    for (int i = 100; i < 150; i++) tree.add(i, i * 2);
+    BKUTree<int, int>::AVLTree::Snapshot after = tree.snapshot();
+    bool ok = true;
+    for (int i = 0; i < 150; i++)
+    {
+        if (before.found(i) != (i < 100)) ok = false;
+        if (after.found(i) != (i >= 100 || i % 2 == 1)) ok = false;
+    }
+    check("test_3", ok, "snapshot contents");
+    check("test_3", before.search(4) == 4 && after.search(120) == 240, "snapshot values");
+    cout << "test_3: done" << endl;
+}
+
+bool copyFile(const string& from, const string& to)
+{
+    std::remove(to.c_str());
+    FILE* in = fopen(from.c_str(), "rb");
+    if (!in) return false;
+    FILE* out = fopen(to.c_str(), "wb");
+    char chunk[4096];
+    size_t n;
+    while ((n = fread(chunk, 1, sizeof(chunk), in)) > 0) fwrite(chunk, 1, n, out);
+    fclose(in);
+    fclose(out);
+    return true;
+}
+void removeLogFiles(const string& path)
+{
+    const char* suffixes[] = { ".snap", ".snap.tmp", ".log", ".log.old", ".log.tmp" };
+    for (int i = 0; i < 5; i++) std::remove((path + suffixes[i]).c_str());
+}
+bool holdsOdds(BKUTree<int, int>& tree)
+{
+    vector<int> trace;
+    for (int i = 1; i < 100; i += 2)
+    {
+        try { if (tree.search(i, trace) != i * 3) return false; }
+        catch (const char*) { return false; }
+    }
+    return tree.size() == 50;
+}
+
+// The log replays after a clean close, and after a crash in the middle of a
+// compaction: path.log already rotated to path.log.old, no snapshot yet.
+void test_4()
+{
+    string path = "/tmp/bku_test_4_" + to_string(getpid());
+    string crashed = path + "_crashed";
+    removeLogFiles(path);
+    removeLogFiles(crashed);
+    {
+        BKUTree<int, int> tree;
+        tree.openLog(path);
+        for (int i = 0; i < 100; i++) tree.add(i, i * 3);
+        for (int i = 0; i < 100; i += 2) tree.remove(i);
+        tree.closeLog();
+    }
+    {
+        BKUTree<int, int> tree;
+        tree.openLog(path);
+        check("test_4", holdsOdds(tree), "replay after close");
+        bool thrown = false;
+        try { tree.openLog(path); }
+        catch (const char*) { thrown = true; }
+        check("test_4", thrown, "second openLog");
+        tree.closeLog();
+    }
+    rename((path + ".log").c_str(), (path + ".log.old").c_str());
+    {
+        BKUTree<int, int> tree;
+        tree.openLog(path);
+        check("test_4", holdsOdds(tree), "replay of interrupted compaction");
+        // Crash right after recovery: only what is on disk now survives.
+        copyFile(path + ".snap", crashed + ".snap");
+        copyFile(path + ".log", crashed + ".log");
+        copyFile(path + ".log.old", crashed + ".log.old");
+        tree.closeLog();
+    }
+    {
+        BKUTree<int, int> tree;
+        tree.openLog(crashed);
+        check("test_4", holdsOdds(tree), "crash after recovery");
+        tree.closeLog();
+    }
+    // A crash mid-write tears the last record; records written after the
+    // next open must not end up behind the torn bytes.
+    removeLogFiles(path);
+    {
+        BKUTree<int, int> tree;
+        tree.openLog(path, SYNC_EVERY);
+        for (int i = 0; i < 10; i++) tree.add(i, i);
+        tree.closeLog();
+    }
+    FILE* log = fopen((path + ".log").c_str(), "ab");
+    fwrite("A\x01\x00", 1, 3, log);
+    fclose(log);
+    {
+        BKUTree<int, int> tree;
+        tree.openLog(path, SYNC_EVERY);
+        for (int i = 10; i < 20; i++) tree.add(i, i);
+        tree.closeLog();
+    }
+    {
+        BKUTree<int, int> tree;
+        tree.openLog(path);
+        vector<int> trace;
+        bool ok = tree.size() == 20;
+        for (int i = 0; i < 20 && ok; i++)
+        {
+            try { ok = tree.search(i, trace) == i; }
+            catch (const char*) { ok = false; }
+        }
+        check("test_4", ok, "records after a torn tail");
+        tree.closeLog();
+    }
+    // A log on a full disk: the add must fail and leave the tree unchanged.
+    removeLogFiles(path);
+    if (symlink("/dev/full", (path + ".log").c_str()) == 0)
+    {
+        BKUTree<int, int> tree;
+        tree.openLog(path, SYNC_EVERY);
+        bool thrown = false;
+        try { tree.add(1, 1); }
+        catch (const char*) { thrown = true; }
+        check("test_4", thrown && tree.size() == 0, "write error on a full disk");
+        tree.closeLog();
+    }
+    removeLogFiles(path);
+    removeLogFiles(crashed);
+    cout << "test_4: done" << endl;
+}
+
+// Order statistics stay right as adds and removes rebalance the tree.
+void test_5()
 {
+    BKUTree<int, int> tree;
+    for (int i = 0; i < 200; i++) tree.add((i * 37) % 200 * 2, i);
+    for (int i = 0; i < 400; i += 8) tree.remove(i);
+    // Left: the even keys below 400 that are not multiples of 8.
+    bool ok = tree.size() == 150;
+    for (int k = 0; k < 150; k++)
+    {
+        int key = k / 3 * 8 + k % 3 * 2 + 2;
+        if (tree.select(k) != key || tree.rank(key) != k) ok = false;
+    }
+    check("test_5", ok, "rank/select");
+    check("test_5", tree.rank(-1) == 0 && tree.rank(1000) == 150 && tree.rank(3) == 1, "rank of absent keys");
+    check("test_5", tree.countRange(2, 16) == 6 && tree.countRange(16, 2) == 0, "countRange");
+    bool thrown = false;
+    try { tree.select(150); }
+    catch (const char*) { thrown = true; }
+    check("test_5", thrown, "select out of range");
+    cout << "test_5: done" << endl;
+}
+
+bool holds(BKUTree<int, int>& tree, int key)
+{
+    vector<int> trace;
+    try { return tree.search(key, trace) == key; }
+    catch (const char*) { return false; }
+}
+
+// Bulk removal leaves both trees holding exactly the survivors.
+void test_6()
+{
+    BKUTree<int, int> tree;
+    for (int i = 0; i < 300; i++) tree.add((i * 7) % 300, (i * 7) % 300);
+    vector<int> trace;
+    for (int i = 0; i < 300; i += 13) tree.search(i, trace);
+    check("test_6", tree.eraseRange(100, 199) == 100, "eraseRange count");
+    check("test_6", tree.eraseRange(150, 160) == 0 && tree.eraseRange(9, 0) == 0, "empty ranges");
+    check("test_6", tree.eraseIf([](const int& key, const int&) { return key % 3 == 0; }) == 67, "eraseIf count");
+    bool ok = tree.size() == 133;
+    for (int i = 0; i < 300; i++)
+        if (holds(tree, i) != ((i < 100 || i >= 200) && i % 3 != 0)) ok = false;
+    check("test_6", ok, "contents");
+    tree.add(150, 150);
+    check("test_6", holds(tree, 150) && tree.rank(150) == 66, "add after erase");
+    cout << "test_6: done" << endl;
+}
+
+// String keys: lookups by string_view, arena slots handed back and reused
+// after remove and eraseIf, and a log replayed into the tree's own arena.
+void test_7()
+{
+    // Long keys, so the live slots span several arena chunks.
+    string prefix(400, 'u');
+    StringBKUTree<int> tree;
+    for (int i = 0; i < 300; i++) tree.add(prefix + to_string(1000 + i), i);
+    vector<ArenaKey> trace;
+    bool ok = true;
+    for (int i = 0; i < 300; i += 7)
+    {
+        string key = prefix + to_string(1000 + i);
+        if (tree.search(string_view(key), trace) != i) ok = false;
+    }
+    trace.clear();
+    check("test_7", ok, "search by string_view");
+    bool thrown = false;
+    try { tree.search(prefix, trace); }
+    catch (const char*) { thrown = true; }
+    check("test_7", thrown, "search of a string never added");
+    size_t arena = tree.arenaMemory();
+    for (int i = 0; i < 300; i += 2) tree.remove(prefix + to_string(1000 + i));
+    thrown = false;
+    try { tree.remove(prefix + "1000"); }
+    catch (const char*) { thrown = true; }
+    check("test_7", thrown && tree.size() == 150 && tree.memoryUsage().payload == 150 * ArenaKey::slotSize(404), "remove");
+    for (int i = 0; i < 150; i++) tree.add(prefix + to_string(2000 + i), i);
+    check("test_7", tree.arenaMemory() <= arena, "slots reused after remove");
+    check("test_7", tree.eraseIf([](const ArenaKey& key, const int&) { return key.view()[400] < '2'; }) == 150, "eraseIf count");
+    check("test_7", tree.memoryUsage().payload == 150 * ArenaKey::slotSize(404), "payload after eraseIf");
+    for (int i = 0; i < 150; i++) tree.add(prefix + to_string(3000 + i), i);
+    check("test_7", tree.arenaMemory() <= arena, "slots reused after eraseIf");
+
+    string path = "/tmp/bku_test_7_" + to_string(getpid());
+    removeLogFiles(path);
+    {
+        StringBKUTree<int> logged;
+        logged.openLog(path);
+        for (int i = 0; i < 50; i++) logged.add("key/" + to_string(i), i);
+        logged.remove("key/7");
+        logged.closeLog();
+    }
+    StringBKUTree<int> replayed;
+    replayed.openLog(path);
+    ok = replayed.size() == 49 && replayed.search("key/42", trace) == 42;
+    thrown = false;
+    try { replayed.search("key/7", trace); }
+    catch (const char*) { thrown = true; }
+    check("test_7", ok && thrown, "replay after close");
+    replayed.closeLog();
+    removeLogFiles(path);
+    cout << "test_7: done" << endl;
+}
+
+// A key type with == and < but no std::hash.
+class PlainKey {
+public:
+    int id;
+    PlainKey(int id = 0) : id(id) {}
+    bool operator==(const PlainKey& other) const { return this->id == other.id; }
+    bool operator<(const PlainKey& other) const { return this->id < other.id; }
+};
+
+// The filter stays in sync through add and remove: no key in the tree is
+// rejected, removed keys are turned away before either tree is searched,
+// and misses pass at about the rate it reports. A tree that never enables
+// the filter compiles without std::hash.
+void test_8()
+{
+    BKUTree<int, int> tree;
+    for (int i = 0; i < 500; i++) tree.add(i * 2, i * 2);
+    tree.enableFilter(1000, 0.01);
+    for (int i = 500; i < 1000; i++) tree.add(i * 2, i * 2);
+    for (int i = 0; i < 2000; i += 4) tree.remove(i);
+    bool ok = tree.filter->numOfKeys == 500;
+    for (int i = 2; i < 2000; i += 4)
+        if (!tree.filter->mayContain(i) || !holds(tree, i)) ok = false;
+    check("test_8", ok, "no false negatives");
+    int rejected = 0;
+    tree.resetSearchPaths();
+    for (int i = 0; i < 2000; i += 4)
+    {
+        if (!tree.filter->mayContain(i)) rejected++;
+        if (holds(tree, i)) ok = false;
+    }
+    check("test_8", ok && rejected >= 490 && tree.searchPaths[MISS] == 500, "removed keys rejected");
+    int passed = 0, n = 100000;
+    for (int i = 0; i < n; i++)
+        if (tree.filter->mayContain(2001 + i * 2)) passed++;
+    double measured = (double)passed / n;
+    check("test_8", measured < 3 * tree.filterFalsePositiveRate() + 0.001, "false positive rate");
+
+    BKUTree<PlainKey, int> plain;
+    for (int i = 0; i < 100; i++) plain.add(PlainKey(i), i);
+    for (int i = 0; i < 100; i += 2) plain.remove(PlainKey(i));
+    vector<PlainKey> trace;
+    check("test_8", plain.size() == 50 && plain.search(PlainKey(41), trace) == 41, "key without std::hash");
+    cout << "test_8: done" << endl;
+}
+
+// What each splay policy does to a path of 1024 keys. AlwaysSplay brings
+// the key to the root and halves the path; SemiSplay halves the key's depth
+// on every access; EveryKthSplay and ThresholdSplay do not rotate until the
+// key's access count comes up.
+void test_9()
+{
+    BKUTree<int, int, AlwaysSplay>::SplayTree always;
+    BKUTree<int, int, SemiSplay>::SplayTree semi;
+    BKUTree<int, int, EveryKthSplay<4> >::SplayTree every;
+    BKUTree<int, int, ThresholdSplay<8> >::SplayTree threshold;
+    for (int i = 0; i < 1024; i++)
+    {
+        always.add(i, i);
+        semi.add(i, i);
+        every.add(i, i);
+        threshold.add(i, i);
+    }
+    // Adds that splay leave 0 at the bottom, the others leave 1023 there.
+    bool ok = always.depth(0) == 1023 && semi.depth(0) == 1022
+        && every.depth(1023) == 1023 && threshold.depth(1023) == 1023;
+    check("test_9", ok, "ascending adds build a path");
+    always.search(0);
+    check("test_9", always.depth(0) == 0 && always.height() <= 514, "AlwaysSplay");
+    semi.search(0);
+    ok = semi.depth(0) >= 510 && semi.depth(0) <= 512;
+    for (int i = 0; i < 9; i++)
+    {
+        int before = semi.depth(0);
+        semi.search(0);
+        if (semi.depth(0) > before / 2 + 1) ok = false;
+    }
+    check("test_9", ok && semi.height() <= 16, "SemiSplay");
+    every.rotations = threshold.rotations = 0;
+    for (int i = 0; i < 2; i++) every.search(1023);
+    for (int i = 0; i < 6; i++) threshold.search(1023);
+    ok = every.rotations == 0 && threshold.rotations == 0;
+    every.search(1023);
+    threshold.search(1023);
+    check("test_9", ok && every.depth(1023) == 0 && threshold.depth(1023) == 0, "EveryKthSplay and ThresholdSplay");
+    cout << "test_9: done" << endl;
+}
+
+// A trace survives saveTrace/loadTrace and replays to the same tree. At
+// the recorded times the replay takes as long as the recording spans.
+void test_10()
+{
+    string path = "/tmp/bku_test_10_" + to_string(getpid()) + ".trace";
+    BKUTree<int, int> tree;
+    tree.startTrace(true);
+    for (int i = 0; i < 100; i++) tree.add(i, i * 3);
+    for (int i = 0; i < 100; i += 2) tree.remove(i);
+    for (int i = 0; i < 200; i += 3) holds(tree, i);
+    try { tree.add(1, 1); }
+    catch (const char*) {}
+    vector<BKUTree<int, int>::TraceRecord> records = tree.stopTrace();
+    long misses = tree.searchPaths[MISS];
+    BKUTree<int, int>::saveTrace(path, records);
+    vector<BKUTree<int, int>::TraceRecord> loaded = BKUTree<int, int>::loadTrace(path);
+    bool ok = loaded.size() == records.size() && loaded.size() == 218;
+    for (size_t i = 0; ok && i < loaded.size(); i++)
+    {
+        if (loaded[i].op != records[i].op || loaded[i].key != records[i].key || loaded[i].time != records[i].time
+            || (loaded[i].op == 'A' && loaded[i].value != records[i].value)) ok = false;
+    }
+    check("test_10", ok, "saveTrace/loadTrace round trip");
+    BKUTree<int, int> replayed;
+    ReplayReport report = replayTrace(replayed, loaded);
+    check("test_10", report.ops == 218 && report.errors == misses + 1 && report.searchPaths[MISS] == misses, "replay report");
+    check("test_10", holdsOdds(replayed), "replayed contents");
+
+    // Ten operations 2 ms apart.
+    for (int i = 0; i < 10; i++) loaded[i].time = 1000000 + i * 2000000LL;
+    loaded.resize(10);
+    BKUTree<int, int> paced;
+    report = replayTrace(paced, loaded, 0, 1.0);
+    double full = report.seconds;
+    BKUTree<int, int> faster;
+    report = replayTrace(faster, loaded, 0, 0.25);
+    check("test_10", full >= 0.018 && report.seconds >= 0.0045 && paced.size() == 10, "replay at recorded times");
+    for (int i = 0; i < 10; i++) loaded[i].time = 0;
+    bool thrown = false;
+    try { replayTrace(faster, loaded, 0, 1.0); }
+    catch (const char*) { thrown = true; }
+    check("test_10", thrown, "recorded times without timestamps");
+    std::remove(path.c_str());
+    cout << "test_10: done" << endl;
+}
+
+// memoryUsage() adds up per part, a full tree rejects adds, and with
+// eviction on it drops cold keys for good: they are gone from both trees
+// and from the log.
+void test_11()
+{
+    BKUTree<int, string> tree;
+    string value(100, 'v');
+    for (int i = 0; i < 100; i++) tree.add(i, value);
+    size_t entry = tree.entryMemory(0, value);
+    BKUTree<int, string>::MemoryUsage usage = tree.memoryUsage();
+    size_t payload = 100 * HeapSize<string>::of(value);
+    bool ok = tree.usedMemory == 100 * entry && usage.payload == payload && usage.snapshots == 0
+        && usage.nodes == 101 * (entry - HeapSize<string>::of(value)) && usage.keysWindow == 5 * sizeof(int)
+        && usage.total() > usage.nodes + usage.payload;
+    check("test_11", ok, "memoryUsage");
+    tree.enableSnapshots();
+    usage = tree.memoryUsage();
+    check("test_11", usage.snapshots > payload && tree.usedMemory == 100 * tree.entryMemory(0, value), "memoryUsage with snapshots");
+    tree.disableSnapshots();
+    check("test_11", tree.memoryUsage().snapshots == 0 && tree.usedMemory == 100 * entry, "snapshots off");
+
+    tree.setMemoryLimit(102 * entry);
+    tree.add(100, value);
+    tree.add(101, value);
+    bool thrown = false;
+    try { tree.add(102, value); }
+    catch (const char*) { thrown = true; }
+    check("test_11", thrown && tree.size() == 102 && tree.usedMemory == 102 * entry, "limit rejects");
+    tree.setMemoryLimit(0);
+    tree.add(102, value);
+
+    string path = "/tmp/bku_test_11_" + to_string(getpid());
+    removeLogFiles(path);
+    {
+        BKUTree<int, int> cache;
+        cache.openLog(path);
+        for (int i = 0; i < 100; i++) cache.add(i, i);
+        vector<int> trace;
+        for (int round = 0; round < 20; round++)
+            for (int i = 40; i < 50; i++) cache.search(i, trace);
+        cache.setMemoryLimit(cache.usedMemory, true);
+        for (int i = 100; i < 150; i++) cache.add(i, i);
+        int hot = 0, added = 0;
+        for (int i = 40; i < 50; i++) hot += holds(cache, i);
+        for (int i = 100; i < 150; i++) added += holds(cache, i);
+        // Half of the old keys had to go; the searched ones fared better.
+        check("test_11", cache.size() == 100 && cache.rank(100) == 50 && added == 50 && hot > 5, "evict");
+        ok = true;
+        for (int i = 0; i < 150; i++)
+            if (holds(cache, i) != cache.splay->found(i)) ok = false;
+        check("test_11", ok, "evicted from both trees");
+        cache.closeLog();
+    }
+    BKUTree<int, int> reopened;
+    reopened.openLog(path);
+    check("test_11", reopened.size() == 100 && reopened.rank(100) == 50, "evictions logged");
+    reopened.closeLog();
+    removeLogFiles(path);
+    BKUTree<int, int> empty;
+    check("test_11", !empty.evict(), "evict on an empty tree");
+    cout << "test_11: done" << endl;
+}
+
+// searchMany agrees with avl->found on hits and misses for every group
+// size, including 1 and more than the batch, and clears values on an
+// empty batch.
+void test_12()
+{
+    BKUTree<int, int> tree;
+    for (int i = 0; i < 500; i++) tree.add(i * 3, i);
+    vector<int> keys;
+    for (int i = 0; i < 999; i++) keys.push_back((i * 7919) % 1600 - 50);
+    // End on a hit, so a dropped last lookup shows.
+    keys.push_back(1497);
+    int groups[] = { 0, 1, 2, 16, 999, 1000, 5000 };
+    bool ok = true;
+    int hits = 0;
+    for (int g = 0; g < 7; g++)
+    {
+        vector<int*> values;
+        tree.searchMany(keys, values, groups[g]);
+        if (values.size() != keys.size()) ok = false;
+        for (size_t i = 0; ok && i < keys.size(); i++)
+        {
+            bool found = tree.avl->found(keys[i]);
+            if ((values[i] != nullptr) != found || (found && *values[i] != keys[i] / 3)) ok = false;
+            if (g == 0 && found) hits++;
+        }
+    }
+    check("test_12", ok && hits > 100 && hits < 900, "matches avl->found");
+    vector<int> none;
+    vector<int*> values(3, nullptr);
+    tree.searchMany(none, values);
+    check("test_12", values.empty(), "empty batch");
+    cout << "test_12: done" << endl;
+}
+
+int main(int argc, char** argv)
+{
+    if (argc > 1 && strcmp(argv[1], "bench") == 0)
+    {
+        bench();
+        return 0;
+    }
+    if (argc > 1 && (strcmp(argv[1], "record") == 0 || strcmp(argv[1], "replay") == 0))
+    {
+        return traceTool(argc, argv);
+    }
     test_1();
     test_2();
-    return 0;
+    test_3();
+    test_4();
+    test_5();
+    test_6();
+    test_7();
+    test_8();
+    test_9();
+    test_10();
+    test_11();
+    test_12();
+    return failures ? 1 : 0;
 }
\ No newline at end of file